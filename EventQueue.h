@@ -0,0 +1,181 @@
+/*
+ * Single producer, single consumer queue of MIDI events, used to hand the
+ * events of the button scan to the USB task.
+ *
+ * Events are queued whole, so a full queue drops the new event rather than
+ * part of one. head is only written by the producer and tail only by the
+ * consumer. Both are single bytes that run freely and are masked on access,
+ * so neither side needs an atomic block and head - tail is the fill.
+ *
+ * Each queue has its own storage, sized when it is set up. With
+ * EVENT_QUEUE_STATS the producer also keeps the high-water mark, the number
+ * of events dropped and a histogram of the fill after each push.
+ */
+
+#ifndef _EVENT_QUEUE_H_
+#define _EVENT_QUEUE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef EVENT_QUEUE_STATS
+#define EVENT_QUEUE_STATS 1
+#endif
+
+//histogram bins, the fill after a push in eighths of the queue size
+#define EVENT_QUEUE_BINS 8
+
+//queue sizes have to be a power of two, at most 128
+#define EVENT_QUEUE_SIZE_OK(n) ((n) >= 1 && (n) <= 128 && !((n) & ((n) - 1)))
+
+//keeps the event copies on the right side of the index updates
+#define EVENT_QUEUE_BARRIER() __asm__ __volatile__ ("" ::: "memory")
+
+typedef struct {
+	uint8_t chan;
+	uint8_t num;
+	uint8_t val;
+} midi_event_t;
+
+typedef struct {
+	midi_event_t * events;
+	uint8_t mask;
+	//log2 of the size
+	uint8_t shift;
+	volatile uint8_t head;
+	volatile uint8_t tail;
+#if EVENT_QUEUE_STATS
+	//written by the producer only
+	uint8_t high_water;
+	uint16_t drops;
+	uint16_t histogram[EVENT_QUEUE_BINS];
+#endif
+} EventQueue_t;
+
+//set up q on storage of size events, size being EVENT_QUEUE_SIZE_OK
+static inline void EventQueue_Init(EventQueue_t * q, midi_event_t * storage, uint8_t size){
+	q->events = storage;
+	q->mask = size - 1;
+	for(q->shift = 0; (1 << q->shift) < size; q->shift++)
+		;
+	q->head = q->tail = 0;
+#if EVENT_QUEUE_STATS
+	{
+		uint8_t i;
+		q->high_water = 0;
+		q->drops = 0;
+		for(i = 0; i < EVENT_QUEUE_BINS; i++)
+			q->histogram[i] = 0;
+	}
+#endif
+}
+
+static inline uint8_t EventQueue_Size(const EventQueue_t * q){
+	return q->mask + 1;
+}
+
+static inline uint8_t EventQueue_Count(const EventQueue_t * q){
+	return (uint8_t)(q->head - q->tail);
+}
+
+/* Statistics: */
+
+#if EVENT_QUEUE_STATS
+//count the fill after a push, fill is at least 1
+static inline void EventQueue_Sample(EventQueue_t * q, uint8_t fill){
+	uint8_t bin = ((uint16_t)(fill - 1) * EVENT_QUEUE_BINS) >> q->shift;
+
+	if(fill > q->high_water)
+		q->high_water = fill;
+	if(q->histogram[bin] != 0xFFFF)
+		q->histogram[bin]++;
+}
+
+static inline void EventQueue_Dropped(EventQueue_t * q, uint8_t n){
+	q->drops = (q->drops > (uint16_t)(0xFFFF - n)) ? 0xFFFF : q->drops + n;
+}
+
+//only safe where the producer can't run at the same time
+static inline void EventQueue_ResetStats(EventQueue_t * q){
+	uint8_t i;
+
+	q->high_water = EventQueue_Count(q);
+	q->drops = 0;
+	for(i = 0; i < EVENT_QUEUE_BINS; i++)
+		q->histogram[i] = 0;
+}
+#else
+#define EventQueue_Sample(q, fill)
+#define EventQueue_Dropped(q, n)
+#define EventQueue_ResetStats(q)
+#endif
+
+/* Producer: */
+
+//false, with nothing queued, when the queue is full
+static inline bool EventQueue_Push(EventQueue_t * q, const midi_event_t * ev){
+	uint8_t head = q->head;
+	uint8_t fill = head - q->tail;
+
+	if(fill > q->mask){
+		EventQueue_Dropped(q, 1);
+		return false;
+	}
+	q->events[head & q->mask] = *ev;
+	EVENT_QUEUE_BARRIER();
+	q->head = head + 1;
+	EventQueue_Sample(q, fill + 1);
+	return true;
+}
+
+//queue the first n events or as many as fit, returns how many were queued
+static inline uint8_t EventQueue_PushBulk(EventQueue_t * q, const midi_event_t * ev, uint8_t n){
+	uint8_t head = q->head;
+	uint8_t fill = head - q->tail;
+	uint8_t space = q->mask + 1 - fill;
+	uint8_t i;
+
+	if(n > space){
+		EventQueue_Dropped(q, n - space);
+		n = space;
+	}
+	if(!n)
+		return 0;
+	for(i = 0; i < n; i++)
+		q->events[(uint8_t)(head + i) & q->mask] = ev[i];
+	EVENT_QUEUE_BARRIER();
+	q->head = head + n;
+	EventQueue_Sample(q, fill + n);
+	return n;
+}
+
+/* Consumer: */
+
+//false when the queue is empty
+static inline bool EventQueue_Pop(EventQueue_t * q, midi_event_t * ev){
+	uint8_t tail = q->tail;
+
+	if(q->head == tail)
+		return false;
+	*ev = q->events[tail & q->mask];
+	EVENT_QUEUE_BARRIER();
+	q->tail = tail + 1;
+	return true;
+}
+
+//take up to n events, returns how many were taken
+static inline uint8_t EventQueue_PopBulk(EventQueue_t * q, midi_event_t * ev, uint8_t n){
+	uint8_t tail = q->tail;
+	uint8_t count = (uint8_t)(q->head - tail);
+	uint8_t i;
+
+	if(n > count)
+		n = count;
+	for(i = 0; i < n; i++)
+		ev[i] = q->events[(uint8_t)(tail + i) & q->mask];
+	EVENT_QUEUE_BARRIER();
+	q->tail = tail + n;
+	return n;
+}
+
+#endif
@@ -36,9 +36,13 @@
  */
 
 #include "MIDI.h"
-#include "RingBuff.h"
 #include <util/delay.h>
+#include <util/atomic.h>
 #include <avr/eeprom.h>
+#include <stddef.h>
+#include <string.h>
+#include <util/crc16.h>
+#include <avr/interrupt.h>
 
 //spells 'buzzr' in ascii
 //1, our 2nd product
@@ -57,54 +61,1255 @@ const uint8_t sysex_version[] = {SYSEX_EDUMANUFID, 98, 117, 122, 122, 114, 1, RE
 uint8_t sysex_button_data[] = {SYSEX_EDUMANUFID, 98, 117, 122, 122, 114, 1, RET_BUTTON_DATA, 0, 1, 2, 3, 4};
 #define SYSEX_BUTTON_DATA_SIZE 13
 
+//refresh rate [Hz], jitter [us], both as two 7 bit bytes msb first
+uint8_t sysex_led_timing[] = {SYSEX_EDUMANUFID, 98, 117, 122, 122, 114, 1, RET_LED_TIMING, 0, 0, 0, 0};
+#define SYSEX_LED_TIMING_SIZE 12
+
+//eager switch lockout [ms]
+uint8_t sysex_debounce[] = {SYSEX_EDUMANUFID, 98, 117, 122, 122, 114, 1, RET_DEBOUNCE, 0};
+#define SYSEX_DEBOUNCE_SIZE 9
+
+//settings bytes not yet written to the eeprom, as two 7 bit bytes msb first
+uint8_t sysex_settings_status[] = {SYSEX_EDUMANUFID, 98, 117, 122, 122, 114, 1, RET_SETTINGS_STATUS, 0, 0};
+#define SYSEX_SETTINGS_STATUS_SIZE 10
+
+//the current page
+uint8_t sysex_page[] = {SYSEX_EDUMANUFID, 98, 117, 122, 122, 114, 1, RET_PAGE, 0};
+#define SYSEX_PAGE_SIZE 9
+
 /* Scheduler Task List */
 TASK_LIST
 {
 	{ .Task = USB_USBTask          , .TaskStatus = TASK_STOP },
 		{ .Task = USB_MIDI_Task        , .TaskStatus = TASK_STOP },
 		{ .Task = BUTTONS_Task        , .TaskStatus = TASK_STOP },
-		{ .Task = LEDS_Task        , .TaskStatus = TASK_STOP },
+		{ .Task = EEPROM_Task         , .TaskStatus = TASK_RUN  },
 };
 
-//hold the data to send
-RingBuff_t midiout_buf;
-//to hold commands
-RingBuff_t cmd_buf;
+#if !EVENT_QUEUE_SIZE_OK(MIDIOUT_QUEUE_SIZE) || !EVENT_QUEUE_SIZE_OK(CMD_QUEUE_SIZE)
+#error "MIDIOUT_QUEUE_SIZE and CMD_QUEUE_SIZE have to be powers of two up to 128"
+#endif
+//button events to send
+midi_event_t midiout_events[MIDIOUT_QUEUE_SIZE];
+EventQueue_t midiout_queue;
+//GET_BUTTON_DATA requests, the sysex index in num
+midi_event_t cmd_events[CMD_QUEUE_SIZE];
+EventQueue_t cmd_queue;
+
+#if EVENT_QUEUE_STATS
+//for each queue: size, fill, high-water mark, as two 7 bit bytes msb first,
+//drops and the EVENT_QUEUE_BINS histogram counts, as three
+#define SYSEX_QUEUE_STATS_BYTES (2 + 2 + 2 + 3 + EVENT_QUEUE_BINS * 3)
+#define SYSEX_QUEUE_STATS_SIZE (SYSEX_HEADER_SIZE + 1 + 2 * SYSEX_QUEUE_STATS_BYTES)
+uint8_t sysex_queue_stats[SYSEX_QUEUE_STATS_SIZE] = {SYSEX_EDUMANUFID, 98, 117, 122, 122, 114, 1, RET_QUEUE_STATS};
+volatile bool send_queue_stats;
+#endif
 
 #define BTN_PER_BOARD 16
-
-volatile uint16_t leds[NUM_BOARDS][4];
+#if NUM_BOARDS * BTN_PER_BOARD > 128
+#error "buttons are addressed with a 7 bit sysex index"
+#endif
+
+//the registers of each board's port, from BOARD_PORTS
+typedef struct {
+	volatile uint8_t * port;
+	volatile uint8_t * pin;
+	volatile uint8_t * ddr;
+} board_io_t;
+#define BOARD_IO(p) {&PORT ## p, &PIN ## p, &DDR ## p},
+const board_io_t board_io[NUM_BOARDS] = {BOARD_PORTS(BOARD_IO)};
+
+//the newest event of each BTN_COALESCE button, sent round robin once the
+//queue is empty. a bit in button_pending for each one not sent yet
+midi_event_t button_latest[NUM_BOARDS][BTN_PER_BOARD];
+uint16_t button_pending[NUM_BOARDS];
+uint8_t button_pending_count;
+//the slot [board * BTN_PER_BOARD + btn] to look at first
+uint8_t button_pending_next;
+
+//the whole button_settings table in sysex index order: chan, num, flags, color
+//of each button
+#define SYSEX_ALL_DATA_SIZE (4 * BTN_PER_BOARD * NUM_BOARDS)
+//it is returned in chunks that fit an IN bank, so button events can go out
+//between them. each is the sysex index of its first button, the data of
+//SYSEX_ALL_CHUNK buttons and a checksum that makes the sum of it all 0 [mod 128]
+#define SYSEX_ALL_CHUNK 8
+#if (BTN_PER_BOARD * NUM_BOARDS) % SYSEX_ALL_CHUNK
+#error "the button count has to be a multiple of SYSEX_ALL_CHUNK"
+#endif
+#define SYSEX_ALL_BUTTON_DATA_SIZE (SYSEX_HEADER_SIZE + 3 + 4 * SYSEX_ALL_CHUNK)
+uint8_t sysex_all_button_data[SYSEX_ALL_BUTTON_DATA_SIZE] =
+	{SYSEX_EDUMANUFID, 98, 117, 122, 122, 114, 1, RET_ALL_BUTTON_DATA};
+//SET_ALL_BUTTON_DATA and SET_LED_FRAME are collected here and applied once
+//the checksum matches
+uint8_t sysex_all_in[SYSEX_ALL_DATA_SIZE];
+
+#define LED_COLUMNS (NUM_BOARDS * 4)
+//bit angle modulation: a column is lit for (2^LED_BAM_BITS - 1) units, showing
+//bitplane n for 2^n of them. timer 0 runs at F_CPU / 64 and fires once per plane
+#define LED_BAM_UNITS ((1 << LED_BAM_BITS) - 1)
+#define LED_BAM_UNIT (F_CPU / 64 / (LED_REFRESH_HZ * 1UL * LED_COLUMNS * LED_BAM_UNITS))
+#if LED_BAM_UNIT < 1
+#error LED_REFRESH_HZ is too high for timer 0
+#elif (LED_BAM_UNIT << (LED_BAM_BITS - 1)) > 256
+#error LED_REFRESH_HZ is too low for timer 0
+#endif
+#if LED_BAM_BITS != 4
+#error the led palette holds 4 bit levels
+#endif
+
+//what goes out on PORTA and PORTE for each bitplane of each column
+typedef struct {
+	uint8_t porta[NUM_BOARDS][4][LED_BAM_BITS];
+	uint8_t porte[NUM_BOARDS][4][LED_BAM_BITS];
+} led_frame_t;
+//the frame being shown and the one SET_LED_FRAME draws into, swapped by the
+//led interrupt at the start of a scan once led_frame_pending is set
+volatile led_frame_t led_frames[2];
+volatile led_frame_t * volatile led_front = &led_frames[0];
+volatile led_frame_t * volatile led_back = &led_frames[1];
+volatile bool led_frame_pending;
+//the plane bytes of the column being lit, picked once per column by the interrupt
+volatile uint8_t * led_col_a;
+volatile uint8_t * led_col_e;
+//clears the ground of led column n on the port of its board
+const uint8_t led_col_strobe[4] = {(uint8_t)~0x01, (uint8_t)~0x04, (uint8_t)~0x10, (uint8_t)~0x40};
+
+//coordinate tables, all the mapping between index spaces is done here at
+//compile time. a button is btn = row * 4 + (3 - col) on its board, the bit it
+//has in button_last and the index into button_settings
+#define TABLE4(f, i) f(i), f((i) + 1), f((i) + 2), f((i) + 3)
+#define TABLE16(f, i) TABLE4(f, i), TABLE4(f, (i) + 4), TABLE4(f, (i) + 8), TABLE4(f, (i) + 12)
+#define TABLE64(f, i) TABLE16(f, i), TABLE16(f, (i) + 16), TABLE16(f, (i) + 32), TABLE16(f, (i) + 48)
+#define TABLE128(f, i) TABLE64(f, i), TABLE64(f, (i) + 64)
+
+//scan: the 4 switch columns on the odd bits of a pin register [active low] as
+//the btn bits of the selected row, col 0 at the top
+#define SWITCH_BITS(pins) ((((pins) & 0x02) ? 0 : 0x8) | (((pins) & 0x08) ? 0 : 0x4) | \
+		(((pins) & 0x20) ? 0 : 0x2) | (((pins) & 0x80) ? 0 : 0x1))
+const uint8_t switch_bits[256] PROGMEM = {TABLE128(SWITCH_BITS, 0), TABLE128(SWITCH_BITS, 128)};
+
+//sysex index: counts across columns, a row of 4 runs over every board before
+//the next row starts. the board * BTN_PER_BOARD + btn of each, the indexes
+//past the last button are never looked up
+#define SYSEX_INDEX_SLOT(index) ((((index) % (4 * NUM_BOARDS)) / 4) * BTN_PER_BOARD + \
+		4 * ((index) / (4 * NUM_BOARDS)) + (index) % 4)
+const uint8_t sysex_index_slot[128] PROGMEM = {TABLE128(SYSEX_INDEX_SLOT, 0)};
+
+//led bit: where the leds of a button sit in the port bytes of its column. its
+//3 leds are bits 3 * (btn / 4) to 3 * (btn / 4) + 2 of a 12 bit word, g b r:
+//bits 0 to 7 are on PORTA, 8 and 9 on PORTE 0 and 1, 10 and 11 on PORTE 6 and 7
+typedef struct {
+	uint8_t col;
+	//g, b, r
+	uint8_t a[3];
+	uint8_t e[3];
+} led_pos_t;
+#define LED_POS_A(n) (((n) < 8) ? (1 << (n)) : 0)
+#define LED_POS_E(n) (((n) < 8) ? 0 : (((n) < 10) ? (1 << ((n) - 8)) : (1 << ((n) - 4))))
+#define LED_POS(btn) {3 - ((btn) % 4), \
+	{LED_POS_A(3 * ((btn) / 4)), LED_POS_A(3 * ((btn) / 4) + 1), LED_POS_A(3 * ((btn) / 4) + 2)}, \
+	{LED_POS_E(3 * ((btn) / 4)), LED_POS_E(3 * ((btn) / 4) + 1), LED_POS_E(3 * ((btn) / 4) + 2)}}
+const led_pos_t led_pos[BTN_PER_BOARD] PROGMEM = {TABLE16(LED_POS, 0)};
 volatile uint8_t led_col;
 volatile uint8_t led_board;
+//the board whose column is lit
+volatile uint8_t led_lit_board;
+volatile uint8_t led_plane;
+
+//levels of the three leds of a button, 4 bits each. the 3 bit colors are 00 rbg
+#define PAL(r, g, b) ((g) | ((b) << 4) | ((uint16_t)(r) << 8))
+//one of the 3 bit colors at a level
+#define PAL_BASIC(color, l) PAL(((color) & 4) ? (l) : 0, ((color) & 1) ? (l) : 0, ((color) & 2) ? (l) : 0)
+#define PAL_RAMP(color) \
+	PAL_BASIC(color, 0), PAL_BASIC(color, 1), PAL_BASIC(color, 2), PAL_BASIC(color, 3), \
+	PAL_BASIC(color, 4), PAL_BASIC(color, 5), PAL_BASIC(color, 6), PAL_BASIC(color, 7), \
+	PAL_BASIC(color, 8), PAL_BASIC(color, 9), PAL_BASIC(color, 10), PAL_BASIC(color, 11), \
+	PAL_BASIC(color, 12), PAL_BASIC(color, 13), PAL_BASIC(color, 14), PAL_BASIC(color, 15)
+
+//maps CC/note values to led levels
+const uint16_t led_palette[128] PROGMEM = {
+	//0 - 7, the 3 bit colors at full brightness like they always were
+	PAL_BASIC(0, 15), PAL_BASIC(1, 15), PAL_BASIC(2, 15), PAL_BASIC(3, 15),
+	PAL_BASIC(4, 15), PAL_BASIC(5, 15), PAL_BASIC(6, 15), PAL_BASIC(7, 15),
+	//8 - 15, mixes: orange, amber, pink, lime, spring, violet, azure, dim white
+	PAL(15, 6, 0), PAL(15, 10, 0), PAL(15, 0, 6), PAL(8, 15, 0),
+	PAL(0, 15, 8), PAL(8, 0, 15), PAL(0, 8, 15), PAL(4, 4, 4),
+	//16 - 127, the 3 bit colors 1 - 7 at 16 levels each: value = 16 * color + level
+	PAL_RAMP(1), PAL_RAMP(2), PAL_RAMP(3), PAL_RAMP(4),
+	PAL_RAMP(5), PAL_RAMP(6), PAL_RAMP(7)
+};
+
+//time between led columns, measured on timer 1 [F_CPU / 8]
+volatile uint16_t led_timer_last;
+volatile uint16_t led_period_min;
+volatile uint16_t led_period_max;
+volatile uint32_t led_period_sum;
+volatile uint16_t led_period_count;
+volatile bool led_timing_reset;
+
+#if PROFILE
+//what is timed. a task's time includes the led interrupts taken while it runs
+enum {
+	PROFILE_USB_MIDI,
+	//the IN side of USB_MIDI_Task, sysex replies and queued CCs
+	PROFILE_SEND,
+	PROFILE_BUTTONS,
+	PROFILE_LEDS,
+	PROFILE_POINTS
+};
+//calls and time per call on timer 1 [F_CPU / 8]. counting stops when count
+//is full, so the sum can't overflow
+typedef struct {
+	uint16_t count;
+	uint16_t min;
+	uint16_t max;
+	uint32_t sum;
+} profile_t;
+volatile profile_t profile[PROFILE_POINTS];
+//times an event packet had to wait because the IN banks were full
+volatile uint16_t profile_stalls;
+#define PROFILE_START(t) uint16_t t = ProfileNow()
+#define PROFILE_END(point, t) ProfileAdd(point, ProfileNow() - (t))
+//in the led interrupt, interrupts are off already
+#define PROFILE_ISR_START(t) uint16_t t = TCNT1
+#define PROFILE_ISR_END(point, t) ProfileAdd(point, TCNT1 - (t))
+#define PROFILE_STALL() do { if(profile_stalls < 0xFFFF) profile_stalls++; } while(0)
+//calls, then min, avg and max cycles of each point, then the stalls. 3 7 bit
+//bytes each, msb first
+#define SYSEX_STATS_SIZE (SYSEX_HEADER_SIZE + 1 + PROFILE_POINTS * 12 + 3)
+uint8_t sysex_stats[SYSEX_STATS_SIZE] = {SYSEX_EDUMANUFID, 98, 117, 122, 122, 114, 1, RET_STATS};
+volatile bool send_stats;
+#else
+#define PROFILE_START(t)
+#define PROFILE_END(point, t)
+#define PROFILE_ISR_START(t)
+#define PROFILE_ISR_END(point, t)
+#define PROFILE_STALL()
+#endif
 volatile uint8_t row;
-volatile uint8_t history;
-volatile uint16_t button_history[NUM_BOARDS][HISTORY];
+//2 bit vertical counters, bit i of cnt1:cnt0 counts the scans button i has
+//read different from its debounced state in button_last
+#if HISTORY != 4
+#error "the vertical counter debouncer counts to 4, HISTORY has to be 4"
+#endif
+volatile uint16_t button_cnt0[NUM_BOARDS];
+volatile uint16_t button_cnt1[NUM_BOARDS];
 volatile uint16_t button_last[NUM_BOARDS];
-volatile uint16_t button_toggle[NUM_BOARDS]; //the toggle state.. 1 means down, 0 means up
+//switches with BTN_EAGER set, the ones in their lockout window and when it started
+volatile uint16_t button_eager[NUM_BOARDS];
+volatile uint16_t button_locked[NUM_BOARDS];
+volatile uint16_t button_edge_time[NUM_BOARDS][BTN_PER_BOARD];
+//lockout window [ms] and in timer 1 ticks
+volatile uint8_t debounce_ms;
+volatile uint16_t debounce_window;
+//buttons held through a page change, they stay quiet until they are let go
+volatile uint16_t button_muted[NUM_BOARDS];
+//the flags and colors of the current page kept by UpdateButton in the form
+//the scan uses them, a bit per button and its led color down and up
+uint16_t button_toggle_mask[NUM_BOARDS];
+uint16_t button_midi_led_mask[NUM_BOARDS];
+uint16_t button_page_mask[NUM_BOARDS];
+uint16_t button_coalesce_mask[NUM_BOARDS];
+uint8_t button_color_down[NUM_BOARDS][BTN_PER_BOARD];
+uint8_t button_color_up[NUM_BOARDS][BTN_PER_BOARD];
+
+//sysex message being sent, picked up on the next pass when the IN banks fill up
+const uint8_t * sysex_out;
+//F0 + data + F7, 0 when nothing is being sent
+uint16_t sysex_out_len;
+uint16_t sysex_out_pos;
+uint8_t sysex_out_cable;
 
 volatile bool send_ack;
 volatile bool send_version;
+volatile bool send_led_timing;
+volatile bool send_debounce;
+volatile bool send_all_button_data;
+//sysex index of the next RET_ALL_BUTTON_DATA chunk
+uint8_t all_button_data_index;
+volatile bool send_settings_status;
+volatile bool send_presets;
+volatile bool send_page;
 volatile bool sysex_in;
-volatile uint8_t sysex_in_cnt;
+volatile uint16_t sysex_in_cnt;
 volatile sysex_t sysex_in_type;
 volatile uint8_t sysex_setting_index;
 
-volatile midi_cc_t button_settings[NUM_BOARDS][BTN_PER_BOARD];
+//the mapping pages, each with its own settings, toggle states and led colors.
+//button_settings and button_toggle point at the current page, so a page
+//change is a matter of pointers and of the leds that differ
+volatile midi_cc_t page_settings[NUM_PAGES][NUM_BOARDS][BTN_PER_BOARD];
+volatile uint16_t page_toggle[NUM_PAGES][NUM_BOARDS];
+uint8_t page_leds[NUM_PAGES][NUM_BOARDS][BTN_PER_BOARD];
+uint8_t current_page;
+volatile midi_cc_t (* button_settings)[BTN_PER_BOARD] = page_settings[0];
+volatile uint16_t * button_toggle = page_toggle[0]; //the toggle state.. 1 means down, 0 means up
+//the BTN_PAGE button held to shift to another page and the page to go back to
+#define PAGE_SHIFT_NONE 0xFF
+uint8_t page_shift_board = PAGE_SHIFT_NONE;
+uint8_t page_shift_btn;
+uint8_t page_shift_return;
+
+//midi driven leds by (chan, num). each bucket starts a chain of
+//slots [board * BTN_PER_BOARD + btn] linked through led_map_next
+#define LED_MAP_BUCKETS 128
+#define LED_MAP_NONE 0xFF
+#define LED_MAP_BUCKET(chan, num) (((num) ^ ((chan) << 3)) & (LED_MAP_BUCKETS - 1))
+uint8_t led_map_head[LED_MAP_BUCKETS];
+uint8_t led_map_next[NUM_BOARDS * BTN_PER_BOARD];
+bool led_map_dirty;
+
+//eeprom stuff! the settings are kept as images in SETTINGS_SLOTS slots. an
+//image is only used when the header matches and the crc [ccitt, lsb first]
+//over everything before it checks out. changes go to a fresh slot, round
+//robin, so no cell is rewritten on every edit and the last complete image
+//stays until the new one is done. the newest image is loaded at boot, or the
+//defaults when there is none. the newest image of each preset is kept until
+//the preset is stored again
+#define SETTINGS_MAGIC0 'b'
+#define SETTINGS_MAGIC1 'z'
+#define SETTINGS_VERSION 2
+//as many slots as the eeprom holds, one for the newest image, one to write
+//the next into and the rest for the presets
+#define SETTINGS_IMAGE_SIZE (NUM_BOARDS * BTN_PER_BOARD * 4 + 10)
+#define SETTINGS_SLOTS ((E2END + 1) / SETTINGS_IMAGE_SIZE)
+#define NUM_PRESETS ((SETTINGS_SLOTS - 2 < NUM_PRESETS_MAX) ? SETTINGS_SLOTS - 2 : NUM_PRESETS_MAX)
+#define PRESET_NONE 0x7F
+#define SLOT_NONE 0xFF
+typedef struct {
+	uint8_t magic[2];
+	uint8_t version;
+	//the low byte of SETTINGS_SIZE
+	uint8_t size;
+	//the preset this image was stored as, or PRESET_NONE
+	uint8_t preset;
+	//write sequence number, lsb first. the highest is the newest image
+	uint8_t seq[2];
+	midi_cc_t buttons[NUM_BOARDS][BTN_PER_BOARD];
+	uint8_t debounce_ms;
+	uint8_t crc[2];
+} saved_settings_t;
+saved_settings_t EEMEM settings_slots[SETTINGS_SLOTS];
+#define SETTINGS_SIZE sizeof(saved_settings_t)
+#define SETTINGS_CRC_OFFSET (SETTINGS_SIZE - 2)
+#if NUM_PRESETS < 1
+#error "the eeprom has no room for a preset besides the newest image and the next"
+#endif
+
+//write-behind cache of an image: what settings_slot holds once every byte
+//marked in settings_dirty has been written by EEPROM_Task
+saved_settings_t settings_cache;
+uint8_t settings_dirty[(SETTINGS_IMAGE_SIZE + 7) / 8];
+uint16_t settings_dirty_count;
+uint16_t settings_commit_pos;
+//the slot the cache mirrors, the newest complete image and the next slot to try
+uint8_t settings_slot;
+uint8_t settings_last_slot;
+uint8_t settings_next_slot;
+uint16_t settings_seq;
+//the newest image of each preset
+uint8_t preset_slot[NUM_PRESETS];
+//changed since the last image was done, EEPROM_Task picks the new slot
+bool settings_moving;
+//the crc is recomputed and written last, once all other bytes are out
+bool settings_crc_stale;
+//ack a FLUSH_SETTINGS or STORE_PRESET once everything is written
+bool settings_flush_ack;
+//a recalled preset is only in ram, FLUSH_SETTINGS or the next change writes
+//it as the newest image
+bool settings_recalled;
+//a RECALL_PRESET that came in while that ack was due, done by EEPROM_Task
+//once the ack has gone out
+uint8_t settings_recall = PRESET_NONE;
+
+//the current preset [0x7F for none], then 1 for each preset that is stored, 0 if not
+uint8_t sysex_presets[SYSEX_HEADER_SIZE + 2 + NUM_PRESETS] = {SYSEX_EDUMANUFID, 98, 117, 122, 122, 114, 1, RET_PRESETS};
+#define SYSEX_PRESETS_SIZE (SYSEX_HEADER_SIZE + 2 + NUM_PRESETS)
+
+//the board and btn of a sysex index
+void sysex_index_mapping(uint8_t index, uint8_t * board, uint8_t * btn){
+	uint8_t slot = pgm_read_byte(&sysex_index_slot[index]);
+	*board = slot / BTN_PER_BOARD;
+	*btn = slot % BTN_PER_BOARD;
+}
+
+#if PROFILE
+static inline uint16_t ProfileNow(void){
+	uint16_t now;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		now = TCNT1;
+	}
+	return now;
+}
+
+static inline void ProfileAdd(uint8_t point, uint16_t ticks){
+	volatile profile_t * p = &profile[point];
+
+	if(p->count == 0xFFFF)
+		return;
+	if(!p->count || ticks < p->min)
+		p->min = ticks;
+	if(ticks > p->max)
+		p->max = ticks;
+	p->sum += ticks;
+	p->count++;
+}
+
+#endif
+
+//start the profile counters and the queue statistics over
+void ResetStats(void){
+#if PROFILE
+	uint8_t i;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		for(i = 0; i < PROFILE_POINTS; i++){
+			profile[i].count = profile[i].min = profile[i].max = 0;
+			profile[i].sum = 0;
+		}
+		profile_stalls = 0;
+	}
+#endif
+	//both queues are only pushed from the main loop
+	EventQueue_ResetStats(&midiout_queue);
+	EventQueue_ResetStats(&cmd_queue);
+}
+
+//the event for button index to send
+void ButtonEvent(midi_event_t * ev, uint8_t board, uint8_t index, uint8_t val){
+	ev->chan = button_settings[board][index].chan;
+	ev->num = button_settings[board][index].num;
+	ev->val = val;
+}
+
+//the event for button index to send, 1 when it is to be queued in ev and 0
+//when it replaced the button's last one in button_latest [BTN_COALESCE]. that
+//is only while the host falls behind, with events still queued. a pending
+//event for another CC, after a page change or new settings, isn't replaced
+//but handed back in ev to be queued
+uint8_t ButtonOut(midi_event_t * ev, uint8_t board, uint8_t index, uint8_t val){
+	uint16_t bit = (uint16_t)1 << index;
+	midi_event_t * latest = &button_latest[board][index];
+
+	ButtonEvent(ev, board, index, val);
+	if(!(button_coalesce_mask[board] & bit))
+		return 1;
+	if(!(button_pending[board] & bit)){
+		if(!EventQueue_Count(&midiout_queue))
+			return 1;
+		button_pending[board] |= bit;
+		button_pending_count++;
+	} else if(latest->chan != ev->chan || latest->num != ev->num){
+		midi_event_t pending = *latest;
+		*latest = *ev;
+		*ev = pending;
+		return 1;
+	}
+	*latest = *ev;
+	return 0;
+}
+
+//the next pending coalesced event, round robin over the grid
+bool PopLatest(midi_event_t * ev){
+	uint8_t n;
+
+	if(!button_pending_count)
+		return false;
+	for(n = 0; n < NUM_BOARDS * BTN_PER_BOARD; n++){
+		uint8_t slot = button_pending_next;
+		uint8_t board = slot / BTN_PER_BOARD;
+		uint16_t bit = (uint16_t)1 << (slot % BTN_PER_BOARD);
+
+		button_pending_next = (slot + 1 == NUM_BOARDS * BTN_PER_BOARD) ? 0 : slot + 1;
+		if(button_pending[board] & bit){
+			button_pending[board] &= ~bit;
+			button_pending_count--;
+			*ev = button_latest[board][slot % BTN_PER_BOARD];
+			return true;
+		}
+	}
+	return false;
+}
+
+//set the eager switch lockout window, clamped to what timer 1 can time
+void SetDebounce(uint8_t ms){
+	if(ms > DEBOUNCE_LOCKOUT_MAX_MS)
+		ms = DEBOUNCE_LOCKOUT_MAX_MS;
+	debounce_ms = ms;
+	debounce_window = (uint16_t)ms * (uint16_t)(F_CPU / 8 / 1000);
+}
+
+//set or clear bit in mask
+#define SET_MASK(mask, bit, set) ((set) ? ((mask) | (bit)) : ((mask) & ~(bit)))
+
+//keep the masks and colors the scan uses in step with the settings of button btn
+void UpdateButton(uint8_t board, uint8_t btn){
+	uint16_t bit = (uint16_t)1 << btn;
+	uint8_t flags = button_settings[board][btn].flags;
+	uint8_t color = button_settings[board][btn].color;
+
+	button_locked[board] &= ~bit;
+	button_eager[board] = SET_MASK(button_eager[board], bit, flags & BTN_EAGER);
+	button_toggle_mask[board] = SET_MASK(button_toggle_mask[board], bit, flags & BTN_TOGGLE);
+	button_midi_led_mask[board] = SET_MASK(button_midi_led_mask[board], bit, flags & BTN_LED_MIDI_DRIVEN);
+	button_page_mask[board] = SET_MASK(button_page_mask[board], bit, flags & BTN_PAGE);
+	button_coalesce_mask[board] = SET_MASK(button_coalesce_mask[board], bit, flags & BTN_COALESCE);
+	button_color_down[board][btn] = color & 0x7;
+	button_color_up[board][btn] = (color >> 3) & 0x7;
+}
+
+//draw a palette color for the led of button btn [button_settings index] into
+//frame, updating the port bytes of every bitplane of its column
+void DrawLED(volatile led_frame_t * frame, uint8_t board, uint8_t btn, uint8_t color){
+	uint16_t levels = pgm_read_word(&led_palette[color & 0x7F]);
+	const led_pos_t * pos = &led_pos[btn];
+	uint8_t col = pgm_read_byte(&pos->col);
+	volatile uint8_t * porta = frame->porta[board][col];
+	volatile uint8_t * porte = frame->porte[board][col];
+	uint8_t a[3], e[3];
+	uint8_t mask_a, mask_e, plane;
+
+	for(plane = 0; plane < 3; plane++){
+		a[plane] = pgm_read_byte(&pos->a[plane]);
+		e[plane] = pgm_read_byte(&pos->e[plane]);
+	}
+	mask_a = ~(a[0] | a[1] | a[2]);
+	mask_e = ~(e[0] | e[1] | e[2]);
+
+	//bit 0 of each level is plane 0
+	for(plane = 0; plane < LED_BAM_BITS; plane++, levels >>= 1){
+		uint8_t bits_a = 0, bits_e = 0;
+		if(levels & 0x001){
+			bits_a |= a[0];
+			bits_e |= e[0];
+		}
+		if(levels & 0x010){
+			bits_a |= a[1];
+			bits_e |= e[1];
+		}
+		if(levels & 0x100){
+			bits_a |= a[2];
+			bits_e |= e[2];
+		}
+		porta[plane] = (porta[plane] & mask_a) | bits_a;
+		porte[plane] = (porte[plane] & mask_e) | bits_e;
+	}
+}
+
+//show a palette color on the led of button btn. a frame that is still to be
+//swapped in gets it as well, so it doesn't undo the change
+void ShowLED(uint8_t board, uint8_t btn, uint8_t color){
+	volatile led_frame_t * front;
+	volatile led_frame_t * back;
+	bool pending;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		front = led_front;
+		back = led_back;
+		pending = led_frame_pending;
+	}
+	DrawLED(front, board, btn, color);
+	if(pending)
+		DrawLED(back, board, btn, color);
+}
+
+//draw a whole frame of palette colors, one per button in sysex index order,
+//to be swapped in at the start of the next scan. every bit of the back frame
+//is drawn, so what it held before doesn't matter
+void SetLEDFrame(const uint8_t * colors){
+	volatile led_frame_t * back;
+	uint8_t index, board, btn;
+
+	//a frame that wasn't swapped in yet is drawn over
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		led_frame_pending = false;
+		back = led_back;
+	}
+	for(index = 0; index < BTN_PER_BOARD * NUM_BOARDS; index++){
+		sysex_index_mapping(index, &board, &btn);
+		page_leds[current_page][board][btn] = colors[index] & 0x7F;
+		DrawLED(back, board, btn, colors[index]);
+	}
+	led_frame_pending = true;
+}
+
+//set the led of button btn on the current page
+void SetLED(uint8_t board, uint8_t btn, uint8_t color){
+	page_leds[current_page][board][btn] = color;
+	ShowLED(board, btn, color);
+}
+
+//index the midi driven buttons by their channel and number
+void BuildLEDMap(void){
+	uint8_t slot;
+
+	for(slot = 0; slot < LED_MAP_BUCKETS; slot++)
+		led_map_head[slot] = LED_MAP_NONE;
+
+	//walk backwards so each chain is in slot order
+	slot = NUM_BOARDS * BTN_PER_BOARD;
+	while(slot--){
+		volatile midi_cc_t * setting = &button_settings[slot / BTN_PER_BOARD][slot % BTN_PER_BOARD];
+		if(setting->flags & BTN_LED_MIDI_DRIVEN){
+			uint8_t bucket = LED_MAP_BUCKET(setting->chan, setting->num);
+			led_map_next[slot] = led_map_head[bucket];
+			led_map_head[bucket] = slot;
+		}
+	}
+	led_map_dirty = false;
+}
+
+//set the color of every midi driven led mapped to chan and num, color is a palette index
+void SetMIDILEDs(uint8_t chan, uint8_t num, uint8_t color){
+	uint8_t slot;
+
+	//pick up mapping changes made over sysex
+	if(led_map_dirty)
+		BuildLEDMap();
+
+	slot = led_map_head[LED_MAP_BUCKET(chan, num)];
+
+	while(slot != LED_MAP_NONE){
+		uint8_t board = slot / BTN_PER_BOARD;
+		uint8_t btn = slot % BTN_PER_BOARD;
+		//buckets are shared, make sure it is really ours
+		if(button_settings[board][btn].chan == chan && button_settings[board][btn].num == num)
+			SetLED(board, btn, color);
+		slot = led_map_next[slot];
+	}
+}
+
+//switch to page p. buttons held on the old page are let go there, momentary
+//ones send their release now, and only the leds that differ are redrawn
+void SetPage(uint8_t p){
+	uint8_t board, btn;
+
+	if(p >= NUM_PAGES || p == current_page)
+		return;
+
+	for(board = 0; board < NUM_BOARDS; board++){
+		uint16_t held = button_last[board] & ~button_muted[board];
+		if(board == page_shift_board)
+			held &= ~((uint16_t)1 << page_shift_btn);
+		for(btn = 0; btn < BTN_PER_BOARD; btn++){
+			//what is lit, the release below only changes what the old page
+			//comes back with
+			uint8_t shown = page_leds[current_page][board][btn];
+			if(((held >> btn) & 0x1) && !(button_settings[board][btn].flags & (BTN_TOGGLE | BTN_PAGE))){
+				midi_event_t ev;
+				if(ButtonOut(&ev, board, btn, 0))
+					EventQueue_Push(&midiout_queue, &ev);
+				if(!(button_settings[board][btn].flags & BTN_LED_MIDI_DRIVEN))
+					page_leds[current_page][board][btn] = (button_settings[board][btn].color >> 3) & 0x7;
+			}
+			if(page_leds[p][board][btn] != shown)
+				ShowLED(board, btn, page_leds[p][board][btn]);
+		}
+		button_muted[board] |= held;
+	}
+
+	current_page = p;
+	button_settings = page_settings[p];
+	button_toggle = page_toggle[p];
+	for(board = 0; board < NUM_BOARDS; board++){
+		for(btn = 0; btn < BTN_PER_BOARD; btn++)
+			UpdateButton(board, btn);
+	}
+	led_map_dirty = true;
+}
+
+//start every other page as a copy of page 0
+void CopyPages(void){
+	uint8_t p;
+
+	for(p = 1; p < NUM_PAGES; p++){
+		memcpy((void *)page_settings[p], (const void *)page_settings[0], sizeof(page_settings[0]));
+		memcpy((void *)page_toggle[p], (const void *)page_toggle[0], sizeof(page_toggle[0]));
+		memcpy(page_leds[p], page_leds[0], sizeof(page_leds[0]));
+	}
+}
+
+//makes the sum of data and the checksum 0 [mod 128]
+uint8_t SysexChecksum(const uint8_t * data, uint16_t len){
+	uint8_t sum = 0;
+	while(len--)
+		sum += *data++;
+	return (uint8_t)(-sum) & 0x7F;
+}
+
+//mark a byte of the settings cache to be written
+void MarkSetting(uint16_t offset){
+	if(!(settings_dirty[offset / 8] & (1 << (offset % 8)))){
+		settings_dirty[offset / 8] |= 1 << (offset % 8);
+		settings_dirty_count++;
+	}
+}
+
+//put a byte into the settings cache, marking it dirty if it changed
+void CacheSetting(uint16_t offset, uint8_t value){
+	uint8_t * cached = (uint8_t *)&settings_cache + offset;
+
+	if(*cached == value)
+		return;
+	*cached = value;
+	MarkSetting(offset);
+}
+
+void ClearSettingsDirty(void){
+	uint8_t i;
+
+	for(i = 0; i < sizeof(settings_dirty); i++)
+		settings_dirty[i] = 0;
+	settings_dirty_count = settings_commit_pos = 0;
+	settings_moving = settings_crc_stale = settings_flush_ack = false;
+}
+
+//the settings are about to change. unless an image is being written
+//already they go to a new one
+void TouchSettings(void){
+	if(settings_moving || settings_dirty_count || settings_crc_stale)
+		return;
+	settings_moving = settings_crc_stale = true;
+	settings_recalled = false;
+	settings_cache.preset = PRESET_NONE;
+}
+
+//save a byte of settings_cache, it is written out later by EEPROM_Task.
+//nothing is written when the eeprom already holds the value
+void SaveSetting(void * addr, uint8_t value){
+	uint8_t * cached = (uint8_t *)addr;
+
+	if(*cached == value)
+		return;
+	TouchSettings();
+	//a new slot is compared against the whole cache once it is picked
+	if(settings_moving)
+		*cached = value;
+	else
+		CacheSetting(cached - (uint8_t *)&settings_cache, value);
+	settings_crc_stale = true;
+}
+
+//save button btn of the current page, only page 0 is kept in the eeprom
+void SaveButton(uint8_t board, uint8_t btn){
+	if(current_page != 0)
+		return;
+	SaveSetting(&(settings_cache.buttons[board][btn].chan), button_settings[board][btn].chan);
+	SaveSetting(&(settings_cache.buttons[board][btn].num), button_settings[board][btn].num);
+	SaveSetting(&(settings_cache.buttons[board][btn].flags), button_settings[board][btn].flags);
+	SaveSetting(&(settings_cache.buttons[board][btn].color), button_settings[board][btn].color);
+}
+
+uint16_t SettingsCRC(const saved_settings_t * settings){
+	const uint8_t * data = (const uint8_t *)settings;
+	uint16_t crc = 0xFFFF;
+	uint16_t i;
+
+	for(i = 0; i < SETTINGS_CRC_OFFSET; i++)
+		crc = _crc_ccitt_update(crc, data[i]);
+	return crc;
+}
+
+bool SettingsValid(const saved_settings_t * settings){
+	uint16_t crc = SettingsCRC(settings);
+
+	return settings->magic[0] == SETTINGS_MAGIC0 && settings->magic[1] == SETTINGS_MAGIC1 &&
+		settings->version == SETTINGS_VERSION && settings->size == (uint8_t)SETTINGS_SIZE &&
+		settings->crc[0] == (crc & 0xFF) && settings->crc[1] == (crc >> 8);
+}
+
+uint16_t SettingsSeq(const saved_settings_t * settings){
+	return settings->seq[0] | ((uint16_t)settings->seq[1] << 8);
+}
+
+//the newest image and the newest image of each preset, with the cache
+//holding the newest one
+void ScanSettings(void){
+	uint16_t preset_seq[NUM_PRESETS];
+	uint8_t slot, p;
+
+	settings_last_slot = SLOT_NONE;
+	settings_seq = 0;
+	for(p = 0; p < NUM_PRESETS; p++)
+		preset_slot[p] = SLOT_NONE;
+
+	for(slot = 0; slot < SETTINGS_SLOTS; slot++){
+		uint16_t seq;
+		eeprom_busy_wait();
+		eeprom_read_block(&settings_cache, &settings_slots[slot], SETTINGS_SIZE);
+		if(!SettingsValid(&settings_cache))
+			continue;
+		//sequence numbers wrap, the slots in use are never far apart
+		seq = SettingsSeq(&settings_cache);
+		if(settings_last_slot == SLOT_NONE || (int16_t)(seq - settings_seq) > 0){
+			settings_last_slot = slot;
+			settings_seq = seq;
+		}
+		p = settings_cache.preset;
+		if(p < NUM_PRESETS && (preset_slot[p] == SLOT_NONE || (int16_t)(seq - preset_seq[p]) > 0)){
+			preset_slot[p] = slot;
+			preset_seq[p] = seq;
+		}
+	}
+
+	ClearSettingsDirty();
+	settings_slot = settings_last_slot;
+	if(settings_last_slot != SLOT_NONE){
+		eeprom_read_block(&settings_cache, &settings_slots[settings_last_slot], SETTINGS_SIZE);
+		settings_next_slot = (settings_last_slot + 1) % SETTINGS_SLOTS;
+	} else
+		settings_next_slot = 0;
+}
+
+bool SlotInUse(uint8_t slot){
+	uint8_t p;
+
+	if(slot == settings_last_slot)
+		return true;
+	for(p = 0; p < NUM_PRESETS; p++){
+		if(preset_slot[p] == slot)
+			return true;
+	}
+	return false;
+}
+
+//pick the slot for a new image and mark the bytes where what it holds differs
+//from the cache. the crc in the cache is what the slot holds until it is redone.
+//only those bytes are written, and as the slots take turns a byte edited over
+//and over is written once per image in each slot, not once per edit in one
+void BeginSettingsWrite(void){
+	uint8_t * cache = (uint8_t *)&settings_cache;
+	uint8_t * eeprom;
+	uint16_t i;
+
+	do {
+		settings_slot = settings_next_slot;
+		settings_next_slot = (settings_next_slot + 1) % SETTINGS_SLOTS;
+	} while(SlotInUse(settings_slot));
+
+	settings_seq++;
+	settings_cache.seq[0] = settings_seq & 0xFF;
+	settings_cache.seq[1] = settings_seq >> 8;
+
+	eeprom = (uint8_t *)&settings_slots[settings_slot];
+	for(i = 0; i < SETTINGS_SIZE; i++){
+		uint8_t held = eeprom_read_byte(eeprom + i);
+		if(i >= SETTINGS_CRC_OFFSET)
+			cache[i] = held;
+		else if(held != cache[i])
+			MarkSetting(i);
+	}
+	settings_commit_pos = 0;
+	settings_moving = false;
+}
+
+//the last byte of a new image is out
+void FinishSettingsWrite(void){
+	settings_last_slot = settings_slot;
+	if(settings_cache.preset < NUM_PRESETS)
+		preset_slot[settings_cache.preset] = settings_slot;
+	if(settings_flush_ack){
+		settings_flush_ack = false;
+		send_ack = true;
+	}
+}
+
+//the compiled in settings, as create_default_sysex.rb makes them: cc number
+//= sysex index on channel 0, alternating colors. all of it is written back
+void DefaultSettings(void){
+	uint8_t index, board, btn;
+
+	TouchSettings();
+	SaveSetting(&settings_cache.magic[0], SETTINGS_MAGIC0);
+	SaveSetting(&settings_cache.magic[1], SETTINGS_MAGIC1);
+	SaveSetting(&settings_cache.version, SETTINGS_VERSION);
+	SaveSetting(&settings_cache.size, (uint8_t)SETTINGS_SIZE);
+	for(index = 0; index < BTN_PER_BOARD * NUM_BOARDS; index++){
+		sysex_index_mapping(index, &board, &btn);
+		SaveSetting(&settings_cache.buttons[board][btn].chan, 0);
+		SaveSetting(&settings_cache.buttons[board][btn].num, index);
+		SaveSetting(&settings_cache.buttons[board][btn].flags, 0);
+		//up: red + blue or red, down: green or blue
+		SaveSetting(&settings_cache.buttons[board][btn].color, (index % 2 == 0) ? 0x31 : 0x22);
+	}
+	SaveSetting(&settings_cache.debounce_ms, DEBOUNCE_LOCKOUT_MS);
+}
+
+//apply the settings in the cache to page 0
+void LoadSettings(void){
+	uint8_t i, j;
+
+	for(i = 0; i < NUM_BOARDS; i++){
+		for(j = 0; j < BTN_PER_BOARD; j++){
+			button_settings[i][j].chan = 0x0F & settings_cache.buttons[i][j].chan;
+			button_settings[i][j].num = 0x7F & settings_cache.buttons[i][j].num;
+			button_settings[i][j].flags = BTN_FLAGS & settings_cache.buttons[i][j].flags;
+			button_settings[i][j].color = 0x3F & settings_cache.buttons[i][j].color;
+			UpdateButton(i, j);
+			//the led state of a button that is up
+			if(!(button_settings[i][j].flags & BTN_LED_MIDI_DRIVEN))
+				SetLED(i, j, (button_settings[i][j].color >> 3) & 0x7);
+		}
+	}
+
+	BuildLEDMap();
+
+	//a blank eeprom reads 0xFF
+	i = settings_cache.debounce_ms;
+	SetDebounce((i > DEBOUNCE_LOCKOUT_MAX_MS) ? DEBOUNCE_LOCKOUT_MS : i);
+}
+
+//load the newest settings image, or the defaults, as at power up
+void BootSettings(void){
+	ScanSettings();
+	if(settings_last_slot == SLOT_NONE)
+		DefaultSettings();
+	LoadSettings();
+	CopyPages();
+}
+
+//store the current settings as preset p, acked once written. changes made
+//before the ack go into the preset as well
+void StorePreset(uint8_t p){
+	TouchSettings();
+	SaveSetting(&settings_cache.preset, p);
+	settings_flush_ack = true;
+}
+
+//make preset p the current settings, read straight from its slot. changes
+//that were still to be written are dropped. nothing is written, the newest
+//image stays what loads at boot until a FLUSH_SETTINGS or the next change
+bool RecallPreset(uint8_t p){
+	if(p >= NUM_PRESETS || preset_slot[p] == SLOT_NONE)
+		return false;
+	ClearSettingsDirty();
+	SetPage(0);
+	settings_slot = preset_slot[p];
+	eeprom_busy_wait();
+	eeprom_read_block(&settings_cache, &settings_slots[settings_slot], SETTINGS_SIZE);
+	LoadSettings();
+	settings_recalled = true;
+	return true;
+}
+
+//the chunk of the button_settings table starting at first into the
+//RET_ALL_BUTTON_DATA reply
+void FillAllButtonData(uint8_t first){
+	uint8_t * data = &sysex_all_button_data[SYSEX_HEADER_SIZE + 1];
+	uint8_t index, board, btn;
+
+	*data++ = first;
+	for(index = first; index < first + SYSEX_ALL_CHUNK; index++){
+		sysex_index_mapping(index, &board, &btn);
+		*data++ = button_settings[board][btn].chan;
+		*data++ = button_settings[board][btn].num;
+		*data++ = button_settings[board][btn].flags;
+		*data++ = button_settings[board][btn].color;
+	}
+	*data = SysexChecksum(&sysex_all_button_data[SYSEX_HEADER_SIZE + 1], 1 + 4 * SYSEX_ALL_CHUNK);
+}
+
+//replace the whole button_settings table of the current page, saving page 0
+//to the eeprom
+void SetAllButtonData(const uint8_t * data){
+	uint8_t index, board, btn;
+
+	for(index = 0; index < BTN_PER_BOARD * NUM_BOARDS; index++){
+		volatile midi_cc_t * setting;
+		sysex_index_mapping(index, &board, &btn);
+		setting = &button_settings[board][btn];
+		setting->chan = *data++ & 0x0F;
+		setting->num = *data++ & 0x7F;
+		setting->flags = *data++ & BTN_FLAGS;
+		setting->color = *data++ & 0x3F;
+		UpdateButton(board, btn);
+		if(!(setting->flags & BTN_LED_MIDI_DRIVEN))
+			SetLED(board, btn, (setting->color >> 3) & 0x7);
+		SaveButton(board, btn);
+	}
+	led_map_dirty = true;
+}
+
+//one byte of sysex from the host
+void SysexByte(uint8_t byte){
+	//realtime messages may come in the middle of sysex
+	if(byte >= 0xF8)
+		return;
+	if(byte == SYSEX_BEGIN){
+		sysex_in = true;
+		sysex_in_cnt = 0;
+	} else if(byte == SYSEX_END){
+		//if we were in sysex mode and we just got a header [just a ping]
+		//send an ack
+		if(sysex_in && sysex_in_cnt == SYSEX_HEADER_SIZE)
+			send_ack = true;
+		sysex_in = false;
+		return;
+	} else if(byte & 0x80){
+		sysex_in = false;
+		return;
+	} else if(sysex_in){
+		//match the header, foreign sysex is dropped at the first byte that differs
+		if(sysex_in_cnt < SYSEX_HEADER_SIZE){
+			if(sysex_header[sysex_in_cnt] != byte){
+				sysex_in = false;
+				return;
+			}
+		} else {
+			//here we have matched the header and we're parsing input data
+			uint16_t index = sysex_in_cnt - SYSEX_HEADER_SIZE;
+			//if the index is 0 then we're matching the type
+			if(index == 0){
+				if(byte == GET_VERSION){
+					send_version = true;
+					sysex_in = false;
+					return;
+				} else if(byte == GET_LED_TIMING){
+					send_led_timing = true;
+					sysex_in = false;
+					return;
+				} else if(byte == GET_DEBOUNCE){
+					send_debounce = true;
+					sysex_in = false;
+					return;
+				} else if(byte == GET_ALL_BUTTON_DATA){
+					//a new request starts the dump over
+					send_all_button_data = true;
+					all_button_data_index = 0;
+					sysex_in = false;
+					return;
+				} else if(byte == LIST_PRESETS){
+					send_presets = true;
+					sysex_in = false;
+					return;
+				} else if(byte == FLUSH_SETTINGS){
+					//acked by EEPROM_Task once everything is written
+					if(settings_recalled)
+						TouchSettings();
+					if(settings_moving || settings_dirty_count || settings_crc_stale)
+						settings_flush_ack = true;
+					else
+						send_ack = true;
+					sysex_in = false;
+					return;
+				} else if(byte == GET_PAGE){
+					send_page = true;
+					sysex_in = false;
+					return;
+#if PROFILE
+				} else if(byte == GET_STATS){
+					send_stats = true;
+					sysex_in = false;
+					return;
+#endif
+#if EVENT_QUEUE_STATS
+				} else if(byte == GET_QUEUE_STATS){
+					send_queue_stats = true;
+					sysex_in = false;
+					return;
+#endif
+				} else if(byte == RESET_STATS){
+					ResetStats();
+					send_ack = true;
+					sysex_in = false;
+					return;
+				} else if(byte == GET_SETTINGS_STATUS){
+					send_settings_status = true;
+					sysex_in = false;
+					return;
+				} else if (byte < SYSEX_INVALID){
+					sysex_in_type = byte;
+				} else {
+					sysex_in_type = SYSEX_INVALID;
+					sysex_in = false;
+					return;
+				}
+			} else if(sysex_in_type == SET_LED_FRAME){
+				if(index <= BTN_PER_BOARD * NUM_BOARDS){
+					sysex_all_in[index - 1] = byte;
+				} else {
+					//the checksum. not acked, frames come too often for that
+					if(SysexChecksum(sysex_all_in, BTN_PER_BOARD * NUM_BOARDS) == byte)
+						SetLEDFrame(sysex_all_in);
+					sysex_in = false;
+					sysex_in_type = SYSEX_INVALID;
+					return;
+				}
+			} else if(sysex_in_type == SET_ALL_BUTTON_DATA){
+				if(index <= SYSEX_ALL_DATA_SIZE){
+					sysex_all_in[index - 1] = byte;
+				} else {
+					//the checksum, nothing is changed unless it matches
+					if(SysexChecksum(sysex_all_in, SYSEX_ALL_DATA_SIZE) == byte){
+						SetAllButtonData(sysex_all_in);
+						send_ack = true;
+					}
+					sysex_in = false;
+					sysex_in_type = SYSEX_INVALID;
+					return;
+				}
+			} else if(index == 1){
+				if (sysex_in_type == SET_BUTTON_DATA)
+					sysex_setting_index = byte;
+				else if(sysex_in_type == GET_BUTTON_DATA){
+					if(byte < (BTN_PER_BOARD * NUM_BOARDS)){
+						midi_event_t cmd = {0, byte, 0};
+						EventQueue_Push(&cmd_queue, &cmd);
+					}
+					sysex_in = false;
+					sysex_in_type = SYSEX_INVALID;
+				} else if(sysex_in_type == STORE_PRESET){
+					if(byte < NUM_PRESETS)
+						StorePreset(byte);
+					sysex_in = false;
+					sysex_in_type = SYSEX_INVALID;
+					return;
+				} else if(sysex_in_type == RECALL_PRESET){
+					//a recall would drop the write a STORE_PRESET or
+					//FLUSH_SETTINGS waits on, so it waits for the ack
+					if(settings_flush_ack){
+						if(byte < NUM_PRESETS)
+							settings_recall = byte;
+					} else if(RecallPreset(byte))
+						send_ack = true;
+					sysex_in = false;
+					sysex_in_type = SYSEX_INVALID;
+					return;
+				} else if(sysex_in_type == SET_PAGE){
+					if(byte < NUM_PAGES){
+						SetPage(byte);
+						send_ack = true;
+					}
+					sysex_in = false;
+					sysex_in_type = SYSEX_INVALID;
+					return;
+				} else if(sysex_in_type == SET_DEBOUNCE){
+					SetDebounce(byte);
+					SaveSetting(&settings_cache.debounce_ms, debounce_ms);
+					send_ack = true;
+					sysex_in = false;
+					sysex_in_type = SYSEX_INVALID;
+					return;
+				}
+			} else if(index > 1) { 
+				if(sysex_in_type == SET_BUTTON_DATA){
+					//make sure we're in range
+					if(sysex_setting_index < (BTN_PER_BOARD * NUM_BOARDS)){
+						uint8_t board;
+						uint8_t btn;
+						sysex_index_mapping(sysex_setting_index, &board, &btn);
+						//save both to ram and, for page 0, eeprom [for later use]
+						switch(index){
+							case 2:
+								button_settings[board][btn].chan = byte & 0x0F;
+								led_map_dirty = true;
+								SaveButton(board, btn);
+								break;
+							case 3:
+								button_settings[board][btn].num = byte & 0x7F;
+								led_map_dirty = true;
+								SaveButton(board, btn);
+								break;
+							case 4:
+								button_settings[board][btn].flags = byte & BTN_FLAGS;
+								UpdateButton(board, btn);
+								led_map_dirty = true;
+								SaveButton(board, btn);
+								break;
+							case 5:
+								button_settings[board][btn].color = byte & 0x3F;
+								UpdateButton(board, btn);
+								SetLED(board, btn, (button_settings[board][btn].color >> 3) & 0x7);
+								SaveButton(board, btn);
+								send_ack = true;
+								//just fall through
+							default:
+								sysex_in = false;
+								sysex_in_type = SYSEX_INVALID;
+								break;
+						}
+					} else {
+						sysex_in = false;
+						sysex_in_type = SYSEX_INVALID;
+						return;
+					}
+				} else {
+					sysex_in = false;
+					sysex_in_type = SYSEX_INVALID;
+					return;
+				}
+			}
+		}
+		sysex_in_cnt++;
+	}
+}
+
+/* USB-MIDI event packets from the host, dispatched on the code index number
+ * in the low nibble of the first byte. packet[1..3] hold the MIDI message
+ */
+
+//reserved code index numbers
+void MIDIInIgnore(const uint8_t * packet){
+}
+
+//any other message ends sysex, except for realtime
+void MIDIInOther(const uint8_t * packet){
+	sysex_in = false;
+}
+
+//notes drive the leds of the buttons mapped to them, a note off turns them off
+void MIDIInNote(const uint8_t * packet){
+	sysex_in = false;
+	SetMIDILEDs(packet[1] & 0x0F, packet[2],
+			((packet[1] & 0xF0) == MIDI_COMMAND_NOTE_OFF) ? 0 : packet[3]);
+}
+
+//so do CCs, except for the one that selects the page
+void MIDIInCC(const uint8_t * packet){
+	sysex_in = false;
+	if((packet[1] & 0x0F) == PAGE_CC_CHAN && packet[2] == PAGE_CC_NUM){
+		SetPage(packet[3]);
+		return;
+	}
+	SetMIDILEDs(packet[1] & 0x0F, packet[2], packet[3]);
+}
 
-//eeprom stuff!
-midi_cc_t EEMEM saved_button_settings[NUM_BOARDS][BTN_PER_BOARD];
+//sysex start/continue [3 bytes], sysex end [1 - 3 bytes, 1 can also be a
+//system common message] and single bytes, which includes realtime
+void MIDIInSysex(const uint8_t * packet){
+	uint8_t cin = packet[0] & 0x0F;
+	uint8_t len = (cin == 0x4 || cin == 0x7) ? 3 : ((cin == 0x6) ? 2 : 1);
+	uint8_t i;
 
-//remap row, column to an index
-uint8_t index_mapping(uint8_t row, uint8_t col){
-	return row * 4 + (3 - col);
+	for(i = 1; i <= len; i++)
+		SysexByte(packet[i]);
 }
 
+void (* const midi_in_handlers[16])(const uint8_t * packet) = {
+	MIDIInIgnore,  //0x0 misc
+	MIDIInIgnore,  //0x1 cable events
+	MIDIInOther,   //0x2 2 byte system common
+	MIDIInOther,   //0x3 3 byte system common
+	MIDIInSysex,   //0x4 sysex start/continue
+	MIDIInSysex,   //0x5 1 byte system common, sysex end
+	MIDIInSysex,   //0x6 sysex end
+	MIDIInSysex,   //0x7 sysex end
+	MIDIInNote,    //0x8 note off
+	MIDIInNote,    //0x9 note on
+	MIDIInOther,   //0xA poly key pressure
+	MIDIInCC,      //0xB control change
+	MIDIInOther,   //0xC program change
+	MIDIInOther,   //0xD channel pressure
+	MIDIInOther,   //0xE pitch bend
+	MIDIInSysex,   //0xF single byte
+};
+
 int main(void)
 {
-	uint8_t i, j;
+	uint8_t i, j, k;
 
 	row = 0;
-	history = 0;
 	led_col = 0;
 	led_board = 0;
 
@@ -117,22 +1322,22 @@ int main(void)
 	clock_prescale_set(clock_div_1);
 
 	//init ringbuffers
-	Buffer_Initialize(&midiout_buf);
-	Buffer_Initialize(&cmd_buf);
+	EventQueue_Init(&midiout_queue, midiout_events, MIDIOUT_QUEUE_SIZE);
+	EventQueue_Init(&cmd_queue, cmd_events, CMD_QUEUE_SIZE);
 
 	//LED ground outputs and switch inputs
-	DDRC = 0x55;
-	DDRF = 0x55;
+	for(i = 0; i < NUM_BOARDS; i++)
+		*board_io[i].ddr = 0x55;
 	DDRA = 0xFF;
 	DDRE = 0xc3;
 
 	//turn on button pullups
-	PORTC |= 0xAA;
-	PORTF |= 0xAA;
+	for(i = 0; i < NUM_BOARDS; i++)
+		*board_io[i].port |= 0xAA;
 
 	//turn leds off
-	PORTC |= 0x55;
-	PORTF |= 0x55;
+	for(i = 0; i < NUM_BOARDS; i++)
+		*board_io[i].port |= 0x55;
 	PORTA = 0x00;
 	PORTE &= ~(0xc3);
 
@@ -144,33 +1349,20 @@ int main(void)
 
 	//init history and settings
 	for(i = 0; i < NUM_BOARDS; i++){
-		for(j = 0; j < 4; j++)
-			leds[i][j] = 0;
-
-		for(j = 0; j < HISTORY; j++)
-			button_history[i][j] = 0;
+		for(j = 0; j < 4; j++){
+			for(k = 0; k < LED_BAM_BITS; k++)
+				led_front->porta[i][j][k] = led_front->porte[i][j][k] = 0;
+		}
 
+		button_cnt0[i] = button_cnt1[i] = 0;
+		button_eager[i] = button_locked[i] = 0;
 		button_toggle[i] = button_last[i] = 0;
 	}
 
-	for(i = 0; i < NUM_BOARDS; i++){
-		for(j = 0; j < BTN_PER_BOARD; j++){
-			//read in saved settings
-			eeprom_busy_wait();
-			button_settings[i][j].chan = 0x0F & eeprom_read_byte((void *)&(saved_button_settings[i][j].chan));
-			eeprom_busy_wait();
-			button_settings[i][j].num = 0x7F & eeprom_read_byte((void *)&(saved_button_settings[i][j].num));
-			eeprom_busy_wait();
-			button_settings[i][j].flags = BTN_FLAGS & eeprom_read_byte((void *)&(saved_button_settings[i][j].flags));
-			eeprom_busy_wait();
-			button_settings[i][j].color = 0x3F & eeprom_read_byte((void *)&(saved_button_settings[i][j].color));
-			//init led state [all buttons are up]
-			if(!(button_settings[i][j].flags & BTN_LED_MIDI_DRIVEN))
-				leds[i][3 - (j % 4)] |= ((button_settings[i][j].color >> 3) & 0x7) << (3 * (j / 4));
-		}
-	}
+	BootSettings();
 
-	send_version = send_ack = false;
+	send_page = send_presets = send_settings_status = send_all_button_data = send_debounce = false;
+	send_led_timing = send_version = send_ack = false;
 	sysex_in = false;
 	sysex_in_cnt = 0;
 	sysex_in_type = SYSEX_INVALID;
@@ -184,7 +1376,17 @@ int main(void)
 	/* Initialize USB Subsystem */
 	USB_Init();
 
-	Scheduler_SetTaskMode(LEDS_Task, TASK_RUN);
+	//free running timer 1 at F_CPU / 8, the led interrupt times itself with it
+	TCCR1A = 0;
+	TCCR1B = (1 << CS11);
+
+	//timer 0 in CTC mode at F_CPU / 64, shows one led bitplane per compare match
+	led_timing_reset = true;
+	OCR0A = LED_BAM_UNIT - 1;
+	TCCR0A = (1 << WGM01);
+	TCCR0B = (1 << CS01) | (1 << CS00);
+	TIMSK0 = (1 << OCIE0A);
+	sei();
 
 	/* Scheduling - routine never returns, so put this last in the main function */
 	Scheduler_Start();
@@ -219,14 +1421,14 @@ EVENT_HANDLER(USB_Disconnect)
  */
 EVENT_HANDLER(USB_ConfigurationChanged)
 {
-	/* Setup MIDI stream endpoints */
+	/* Setup MIDI stream endpoints, double banked so that one bank can be filled while the host reads the other */
 	Endpoint_ConfigureEndpoint(MIDI_STREAM_OUT_EPNUM, EP_TYPE_BULK,
 			ENDPOINT_DIR_OUT, MIDI_STREAM_EPSIZE,
-			ENDPOINT_BANK_SINGLE);
+			ENDPOINT_BANK_DOUBLE);
 
 	Endpoint_ConfigureEndpoint(MIDI_STREAM_IN_EPNUM, EP_TYPE_BULK,
 			ENDPOINT_DIR_IN, MIDI_STREAM_EPSIZE,
-			ENDPOINT_BANK_SINGLE);
+			ENDPOINT_BANK_DOUBLE);
 
 	/* Indicate USB connected and ready */
 	UpdateStatus(Status_USBReady);
@@ -236,355 +1438,460 @@ EVENT_HANDLER(USB_ConfigurationChanged)
 	Scheduler_SetTaskMode(BUTTONS_Task, TASK_RUN);
 }
 
+/** Starts the next pending sysex reply, the queued GET_BUTTON_DATA replies coming last.
+ *
+ *  \return false if there is nothing to send
+ */
+bool StartSysexReply(void)
+{
+	uint8_t i, j;
+	midi_event_t cmd;
+
+	if(send_ack){
+		send_ack = false;
+		SendSysex(sysex_ack, SYSEX_ACK_SIZE, 0);
+	} else if(send_version){
+		send_version = false;
+		SendSysex(sysex_version, SYSEX_VERSION_SIZE, 0);
+	} else if(send_led_timing){
+		send_led_timing = false;
+		FillLEDTiming();
+		SendSysex(sysex_led_timing, SYSEX_LED_TIMING_SIZE, 0);
+	} else if(send_all_button_data){
+		FillAllButtonData(all_button_data_index);
+		all_button_data_index += SYSEX_ALL_CHUNK;
+		if(all_button_data_index == BTN_PER_BOARD * NUM_BOARDS)
+			send_all_button_data = false;
+		SendSysex(sysex_all_button_data, SYSEX_ALL_BUTTON_DATA_SIZE, 0);
+	} else if(send_settings_status){
+		//before a new slot is picked all of it may have to be written
+		uint16_t count = settings_moving ? SETTINGS_SIZE :
+			settings_dirty_count + (settings_crc_stale ? 2 : 0);
+		send_settings_status = false;
+		sysex_settings_status[SYSEX_SETTINGS_STATUS_SIZE - 2] = (count >> 7) & 0x7F;
+		sysex_settings_status[SYSEX_SETTINGS_STATUS_SIZE - 1] = count & 0x7F;
+		SendSysex(sysex_settings_status, SYSEX_SETTINGS_STATUS_SIZE, 0);
+	} else if(send_presets){
+		send_presets = false;
+		sysex_presets[SYSEX_HEADER_SIZE + 1] = settings_cache.preset & 0x7F;
+		for(i = 0; i < NUM_PRESETS; i++)
+			sysex_presets[SYSEX_HEADER_SIZE + 2 + i] = (preset_slot[i] != SLOT_NONE);
+		SendSysex(sysex_presets, SYSEX_PRESETS_SIZE, 0);
+	} else if(send_page){
+		send_page = false;
+		sysex_page[SYSEX_PAGE_SIZE - 1] = current_page;
+		SendSysex(sysex_page, SYSEX_PAGE_SIZE, 0);
+#if PROFILE
+	} else if(send_stats){
+		send_stats = false;
+		FillStats();
+		SendSysex(sysex_stats, SYSEX_STATS_SIZE, 0);
+#endif
+#if EVENT_QUEUE_STATS
+	} else if(send_queue_stats){
+		send_queue_stats = false;
+		FillQueueStats();
+		SendSysex(sysex_queue_stats, SYSEX_QUEUE_STATS_SIZE, 0);
+#endif
+	} else if(send_debounce){
+		send_debounce = false;
+		sysex_debounce[SYSEX_DEBOUNCE_SIZE - 1] = debounce_ms;
+		SendSysex(sysex_debounce, SYSEX_DEBOUNCE_SIZE, 0);
+	} else if(EventQueue_Pop(&cmd_queue, &cmd)){
+		uint8_t index = cmd.num;
+		sysex_index_mapping(index, &i, &j);
+		//fill the buffer, it isn't touched again until the reply is sent
+		//index, chan, num, flags, color
+		sysex_button_data[SYSEX_BUTTON_DATA_SIZE - 5] = index;
+		sysex_button_data[SYSEX_BUTTON_DATA_SIZE - 4] = button_settings[i][j].chan;
+		sysex_button_data[SYSEX_BUTTON_DATA_SIZE - 3] = button_settings[i][j].num;
+		sysex_button_data[SYSEX_BUTTON_DATA_SIZE - 2] = button_settings[i][j].flags;
+		sysex_button_data[SYSEX_BUTTON_DATA_SIZE - 1] = button_settings[i][j].color;
+		SendSysex(sysex_button_data, SYSEX_BUTTON_DATA_SIZE, 0);
+	} else
+		return false;
+	return true;
+}
+
 /** Task to handle the generation of MIDI note change events in response to presses of the board joystick, and send them
  *  to the host.
  */
 TASK(USB_MIDI_Task)
 {
-	uint8_t i, j, k;
+	midi_event_t cmd;
+	PROFILE_START(task_start);
 	/* Select the MIDI IN stream */
 	Endpoint_SelectEndpoint(MIDI_STREAM_IN_EPNUM);
 
 	/* Check if endpoint is ready to be written to */
 	if (Endpoint_IsINReady())
 	{
-		if(send_ack){
-			send_ack = false;
-			while (!(Endpoint_IsINReady()));
-			SendSysex(sysex_ack, SYSEX_ACK_SIZE, 0);
-		}
-		if(send_version){
-			send_version = false;
-			while (!(Endpoint_IsINReady()));
-			SendSysex(sysex_version, SYSEX_VERSION_SIZE, 0);
+		PROFILE_START(send_start);
+		//two lanes: button events go out first, sysex replies get the packets
+		//left over. a CC would end a sysex message on the host, so the events
+		//take their turn between messages, long replies are sent in chunks.
+		//never wait on the host, whatever doesn't fit now goes out on a later pass
+		for(;;){
+			if(sysex_out_len){
+				if(!ContinueSysex())
+					break;
+			} else if(button_pending_count || EventQueue_Count(&midiout_queue)){
+				//the queue first, a coalesced button's event handed to it
+				//must not be overtaken by a newer one for the same CC
+				if(!MIDIEventReady())
+					break;
+				if(EventQueue_Pop(&midiout_queue, &cmd) || PopLatest(&cmd))
+					SendMIDICC(cmd.num, cmd.val, 0, cmd.chan);
+			} else if(!StartSysexReply())
+				break;
 		}
 
-		while(cmd_buf.Elements){
-			uint8_t index = Buffer_GetElement(&cmd_buf);
-			if (NUM_BOARDS == 0){
-				i = 0;
-				j = index;
-			} else {
-				//remap so that we count across columns
-				i = (index % 8) / 4;
-				j = index - 4 * (index / 4) + 4 * (index / 8);
-			}
-			//fill the buffer
-			//index, chan, num, flags, color
-			button_settings[i][j].num;
-			sysex_button_data[SYSEX_BUTTON_DATA_SIZE - 5] = index;
-			sysex_button_data[SYSEX_BUTTON_DATA_SIZE - 4] = button_settings[i][j].chan;
-			sysex_button_data[SYSEX_BUTTON_DATA_SIZE - 3] = button_settings[i][j].num;
-			sysex_button_data[SYSEX_BUTTON_DATA_SIZE - 2] = button_settings[i][j].flags;
-			sysex_button_data[SYSEX_BUTTON_DATA_SIZE - 1] = button_settings[i][j].color;
-			while (!(Endpoint_IsINReady()));
-			SendSysex(sysex_button_data, SYSEX_BUTTON_DATA_SIZE, 0);
-		}
-
-		if (midiout_buf.Elements > 2){
-			/* Wait until Serial Tx Endpoint Ready for Read/Write */
-			while (!(Endpoint_IsINReady()));
-			if(Endpoint_BytesInEndpoint() < MIDI_STREAM_EPSIZE){
-				uint8_t chan = Buffer_GetElement(&midiout_buf);
-				//the channel always has the top bit set.. 
-				//this way we make sure to line up data if data is dropped
-				//so if we don't have the top bit set, don't grab more data..
-				//we can catch up next time
-				if(chan & 0x80){
-					uint8_t addr = Buffer_GetElement(&midiout_buf);
-					uint8_t val = Buffer_GetElement(&midiout_buf);
-					SendMIDICC(addr & 0x7F, val & 0x7F, 0, chan & 0x0F);
-				}
-			}
-		}
-	}
+		//send everything written this pass in a single transfer
+		FlushMIDIEvents();
+		PROFILE_END(PROFILE_SEND, send_start);
+	} else if(sysex_out_len || button_pending_count || EventQueue_Count(&midiout_queue))
+		PROFILE_STALL();
 
 	/* Select the MIDI OUT stream */
 	Endpoint_SelectEndpoint(MIDI_STREAM_OUT_EPNUM);
 
 	if (Endpoint_IsOUTReceived()){
+		//the whole bank, a 4 byte event packet at a time
 		while (Endpoint_BytesInEndpoint()){
-			uint8_t byte[3];
-			//always comes in packets of 4 bytes
-			byte[0] = Endpoint_Read_Byte();
-			//ditch the first byte and grab the next 3
-			byte[0] = Endpoint_Read_Byte();
-			byte[1] = Endpoint_Read_Byte();
-			byte[2] = Endpoint_Read_Byte();
-
-			//if this is a CC input deal with that
-			if((byte[0] & 0xF0) == MIDI_COMMAND_CC){
-				sysex_in = false;
-				for(j = 0; j < NUM_BOARDS; j++){
-					for(k = 0; k < BTN_PER_BOARD; k++){
-						if((button_settings[j][k].flags & BTN_LED_MIDI_DRIVEN) &&
-								((byte[0] & 0x0F) == button_settings[j][k].chan)){
-							//does the num match
-							if(button_settings[j][k].num == byte[1]){
-								uint8_t index = 3 - (k % 4);
-								uint8_t shift = 3 * (k / 4);
-								//clear
-								leds[j][index] &= ~(0x7 << shift);
-								//set
-								leds[j][index] |=  (byte[2] & 0x7) << shift;
-								break;
-							}
-						} 
-					}
-				}
-			} else {
-				for(i = 0; i < 3; i++){
-					//otherwise, maybe it is sysex data?
-					if(byte[i] == SYSEX_BEGIN){
-						sysex_in = true;
-						sysex_in_cnt = 0;
-					} else if(byte[i] == SYSEX_END){
-						//if we were in sysex mode and we just got a header [just a ping]
-						//send an ack
-						if(sysex_in && sysex_in_cnt == SYSEX_HEADER_SIZE)
-							send_ack = true;
-						sysex_in = false;
-						break;
-					} else if(byte[i] & 0x80){
-						sysex_in = false;
-						break;
-					} else if(sysex_in){
-						//match the header
-						if(sysex_in_cnt < SYSEX_HEADER_SIZE){
-							if(!sysex_header[sysex_in_cnt] == byte[i]){
-								sysex_in = false;
-								break;
-							}
-						} else {
-							//here we have matched the header and we're parsing input data
-							uint8_t index = sysex_in_cnt - SYSEX_HEADER_SIZE;
-							//if the index is 0 then we're matching the type
-							if(index == 0){
-								if(byte[i] == GET_VERSION){
-									send_version = true;
-									sysex_in = false;
-									break;
-								} else if (byte[i] < SYSEX_INVALID){
-									sysex_in_type = byte[i];
-								} else {
-									sysex_in_type = SYSEX_INVALID;
-									sysex_in = false;
-									break;
-								}
-							} else if(index == 1){
-								if (sysex_in_type == SET_BUTTON_DATA)
-									sysex_setting_index = byte[i];
-								else if(sysex_in_type == GET_BUTTON_DATA){
-									if(byte[i] < (BTN_PER_BOARD * NUM_BOARDS))
-										Buffer_StoreElement(&cmd_buf, byte[i]);
-									sysex_in = false;
-									sysex_in_type = SYSEX_INVALID;
-								}
-							} else if(index > 1) { 
-								if(sysex_in_type == SET_BUTTON_DATA){
-									//make sure we're in range
-									if(sysex_setting_index < (BTN_PER_BOARD * NUM_BOARDS)){
-										uint8_t board;
-										uint8_t btn;
-										if (NUM_BOARDS == 0){
-											board = 0;
-											btn = sysex_setting_index;
-										} else {
-											//remap so that we count across columns
-											board = (sysex_setting_index % 8) / 4;
-											btn = sysex_setting_index - 4 * (sysex_setting_index / 4)
-												+ 4 * (sysex_setting_index / 8);
-										}
-										//save both to ram and eeprom [for later use]
-										switch(index){
-											case 2:
-												button_settings[board][btn].chan = byte[i] & 0x0F;
-												eeprom_busy_wait();
-												eeprom_write_byte(
-														(void *)&(saved_button_settings[board][btn].chan),
-														button_settings[board][btn].chan);
-												break;
-											case 3:
-												button_settings[board][btn].num = byte[i] & 0x7F;
-												eeprom_busy_wait();
-												eeprom_write_byte(
-														(void *)&(saved_button_settings[board][btn].num),
-														button_settings[board][btn].num);
-												break;
-											case 4:
-												button_settings[board][btn].flags = byte[i];
-												eeprom_busy_wait();
-												eeprom_write_byte(
-														(void *)&(saved_button_settings[board][btn].flags),
-														button_settings[board][btn].flags);
-												break;
-											case 5:
-												button_settings[board][btn].color = byte[i] & 0x3F;
-												//clear
-												leds[board][3 - (btn % 4)] &= ~(0x7 << (3 * (btn / 4)));
-												//set
-												leds[board][3 - (btn % 4)] |= 
-													((button_settings[board][btn].color >> 3) & 0x7) << (3 * (btn / 4));
-												eeprom_busy_wait();
-												eeprom_write_byte(
-														(void *)&(saved_button_settings[board][btn].color),
-														button_settings[board][btn].color);
-												send_ack = true;
-												//just fall through
-											default:
-												sysex_in = false;
-												sysex_in_type = SYSEX_INVALID;
-												break;
-										}
-									} else {
-										sysex_in = false;
-										sysex_in_type = SYSEX_INVALID;
-										break;
-									}
-								} else {
-									sysex_in = false;
-									sysex_in_type = SYSEX_INVALID;
-									break;
-								}
-							}
-						}
-						sysex_in_cnt++;
-					}
-				}
-			}
+			uint8_t packet[4];
+			packet[0] = Endpoint_Read_Byte();
+			packet[1] = Endpoint_Read_Byte();
+			packet[2] = Endpoint_Read_Byte();
+			packet[3] = Endpoint_Read_Byte();
+			midi_in_handlers[packet[0] & 0x0F](packet);
 		}
 		// Clear the endpoint buffer
 		Endpoint_ClearOUT();
 	}
+	PROFILE_END(PROFILE_USB_MIDI, task_start);
 }
 
-TASK(LEDS_Task)
+//show the next bitplane, at a fixed rate no matter how busy the tasks are.
+//every column shows its planes in turn, plane n for LED_BAM_UNIT << n timer ticks
+ISR(TIMER0_COMPA_vect)
 {
-	//turn all them off
-	PORTC |= 0x55;
-	PORTF |= 0x55;
-	PORTA = (uint8_t)leds[led_board][led_col];
-	PORTE = 0;
-	PORTE = (leds[led_board][led_col] >> 8) & 0x03;
-	PORTE |= (leds[led_board][led_col] >> 4) & 0xc0;
-
-	//set the col
-	if(led_board == 0)
-		PORTC &= ~(0x1 << (led_col << 1));
-	else
-		PORTF &= ~(0x1 << (led_col << 1));
+	uint8_t plane = led_plane;
+	PROFILE_ISR_START(isr_start);
+
+	if(plane == 0){
+		uint16_t now = TCNT1;
+		uint16_t period = now - led_timer_last;
+
+		led_timer_last = now;
+		if(led_timing_reset){
+			led_timing_reset = false;
+			led_period_min = 0xFFFF;
+			led_period_max = 0;
+			led_period_sum = 0;
+			led_period_count = 0;
+		} else if(led_period_count < 0xFFFF){
+			if(period < led_period_min)
+				led_period_min = period;
+			if(period > led_period_max)
+				led_period_max = period;
+			led_period_sum += period;
+			led_period_count++;
+		}
 
-	if(led_col == 3)
-		led_board = (led_board + 1) % 2;
-	led_col = (led_col + 1) % 4;
+		//turn off the column that was lit, only one board has one
+		*board_io[led_lit_board].port |= 0x55;
+		//a new frame only comes in at the start of a scan, so none is shown half
+		if(led_frame_pending && led_board == 0 && led_col == 0){
+			volatile led_frame_t * shown = led_front;
+			led_front = led_back;
+			led_back = shown;
+			led_frame_pending = false;
+		}
+		led_col_a = led_front->porta[led_board][led_col];
+		led_col_e = led_front->porte[led_board][led_col];
+		PORTA = led_col_a[0];
+		PORTE = led_col_e[0];
+
+		//set the col
+		*board_io[led_board].port &= led_col_strobe[led_col];
+		led_lit_board = led_board;
+	} else {
+		PORTA = led_col_a[plane];
+		PORTE = led_col_e[plane];
+	}
+	OCR0A = (LED_BAM_UNIT << plane) - 1;
+
+	if(++plane == LED_BAM_BITS){
+		plane = 0;
+		if(++led_col == 4){
+			led_col = 0;
+			if(++led_board == NUM_BOARDS)
+				led_board = 0;
+		}
+	}
+	led_plane = plane;
+	PROFILE_ISR_END(PROFILE_LEDS, isr_start);
 }
 
-TASK(BUTTONS_Task)
+//put the measured refresh rate and worst case jitter in the reply and start measuring again
+void FillLEDTiming(void)
+{
+	uint32_t sum;
+	uint16_t count, min, max;
+	uint16_t hz = 0;
+	uint16_t jitter = 0;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		sum = led_period_sum;
+		count = led_period_count;
+		min = led_period_min;
+		max = led_period_max;
+		led_timing_reset = true;
+	}
+
+	if(count && sum){
+		hz = (F_CPU / 8) / ((sum / count) * LED_COLUMNS);
+		//timer 1 counts in 1/2 us
+		jitter = (max - min) / (F_CPU / 8 / 1000000);
+	}
+	if(hz > 0x3FFF)
+		hz = 0x3FFF;
+	if(jitter > 0x3FFF)
+		jitter = 0x3FFF;
+
+	sysex_led_timing[SYSEX_LED_TIMING_SIZE - 4] = (hz >> 7) & 0x7F;
+	sysex_led_timing[SYSEX_LED_TIMING_SIZE - 3] = hz & 0x7F;
+	sysex_led_timing[SYSEX_LED_TIMING_SIZE - 2] = (jitter >> 7) & 0x7F;
+	sysex_led_timing[SYSEX_LED_TIMING_SIZE - 1] = jitter & 0x7F;
+}
+
+//value as len 7 bit bytes, msb first, clamped to what they can hold
+uint8_t * Sysex7Bit(uint8_t * data, uint32_t value, uint8_t len){
+	uint8_t i;
+
+	if(value >> (7 * len))
+		value = ((uint32_t)1 << (7 * len)) - 1;
+	for(i = len; i; i--)
+		*data++ = (value >> (7 * (i - 1))) & 0x7F;
+	return data;
+}
+
+#if PROFILE
+void FillStats(void)
 {
-	uint8_t i, j, board;
-
-	for(i = 0; i < 4; i++){
-		uint8_t index = index_mapping(row, i);
-		//zero out the bit we're working with
-		button_history[0][history] &= ~((uint16_t)(1 << index));
-		//set the bit
-		button_history[0][history] |= (uint16_t)((~PINC >> (1 + (i * 2))) & 0x1) << index;
-		if(NUM_BOARDS > 1){
-			//zero out the bit we're working with
-			button_history[1][history] &= ~((uint16_t)(1 << index));
-			//set the bit
-			button_history[1][history] |= (uint16_t)((~PINF >> (1 + (i * 2))) & 0x1) << index;
+	uint8_t * data = &sysex_stats[SYSEX_HEADER_SIZE + 1];
+	uint8_t i;
+
+	for(i = 0; i < PROFILE_POINTS; i++){
+		profile_t p;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+			p = *(profile_t *)&profile[i];
 		}
+		//timer 1 counts 8 cycles
+		data = Sysex7Bit(data, p.count, 3);
+		data = Sysex7Bit(data, (uint32_t)p.min * 8, 3);
+		data = Sysex7Bit(data, p.count ? (p.sum / p.count) * 8 : 0, 3);
+		data = Sysex7Bit(data, (uint32_t)p.max * 8, 3);
 	}
+	Sysex7Bit(data, profile_stalls, 3);
+}
+#endif
+
+#if EVENT_QUEUE_STATS
+uint8_t * FillQueue(uint8_t * data, const EventQueue_t * q){
+	uint8_t i;
+
+	data = Sysex7Bit(data, EventQueue_Size(q), 2);
+	data = Sysex7Bit(data, EventQueue_Count(q), 2);
+	data = Sysex7Bit(data, q->high_water, 2);
+	data = Sysex7Bit(data, q->drops, 3);
+	for(i = 0; i < EVENT_QUEUE_BINS; i++)
+		data = Sysex7Bit(data, q->histogram[i], 3);
+	return data;
+}
+
+void FillQueueStats(void)
+{
+	uint8_t * data = &sysex_queue_stats[SYSEX_HEADER_SIZE + 1];
+
+	data = FillQueue(data, &midiout_queue);
+	FillQueue(data, &cmd_queue);
+}
+#endif
+
+TASK(BUTTONS_Task)
+{
+	uint8_t index, board;
+	//queued together once the row is done
+	midi_event_t events[4 * NUM_BOARDS];
+	uint8_t num_events = 0;
+	uint16_t mask = (uint16_t)0xF << (row * 4);
+	PROFILE_START(task_start);
 
 	for(board = 0; board < NUM_BOARDS; board++){
+		uint16_t sample, delta, cnt0, cnt1, changed, eager;
+		uint16_t special, plain, toggle, down, on, off, bits;
+
+		sample = (uint16_t)pgm_read_byte(&switch_bits[*board_io[board].pin]) << (row * 4);
+		eager = button_eager[board] & mask;
+
+		//debounce the row we just read, a bit changes state after reading
+		//differently HISTORY times in a row
+		delta = (sample ^ button_last[board]) & mask & ~eager;
+		cnt0 = button_cnt0[board];
+		cnt1 = button_cnt1[board];
+		cnt1 = (cnt1 & ~mask) | ((cnt1 ^ cnt0) & delta);
+		cnt0 = (cnt0 & ~mask) | (~cnt0 & delta);
+		button_cnt0[board] = cnt0;
+		button_cnt1[board] = cnt1;
+		changed = delta & ~(cnt0 | cnt1);
+
+		//eager switches change on the first differing read, then sit out the lockout
+		if(eager){
+			uint16_t now, bit;
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+				now = TCNT1;
+			}
+			for(index = row * 4, bit = (uint16_t)1 << index; bit & mask; index++, bit <<= 1){
+				if(!(eager & bit))
+					continue;
+				if(button_locked[board] & bit){
+					if((uint16_t)(now - button_edge_time[board][index]) < debounce_window)
+						continue;
+					button_locked[board] &= ~bit;
+				}
+				if((sample ^ button_last[board]) & bit){
+					changed |= bit;
+					button_locked[board] |= bit;
+					button_edge_time[board][index] = now;
+				}
+			}
+		}
+		button_last[board] ^= changed;
+
+		special = button_muted[board] | button_page_mask[board];
+		if(board == page_shift_board)
+			special |= (uint16_t)1 << page_shift_btn;
+
+		//the rest of the row at once, on the page the buttons were pressed on.
+		//toggle buttons flip going down and stay quiet going up, the others
+		//follow the switch
+		plain = changed & ~special;
+		toggle = button_toggle_mask[board];
+		down = plain & button_last[board];
+		button_toggle[board] ^= down & toggle;
+		on = down & (~toggle | button_toggle[board]);
+		off = (plain & ~down & ~toggle) | (down & toggle & ~button_toggle[board]);
+
+		for(index = row * 4, bits = (on | off) >> index; bits; index++, bits >>= 1){
+			uint16_t bit = (uint16_t)1 << index;
+			if(!(bits & 0x1))
+				continue;
+			num_events += ButtonOut(&events[num_events], board, index, (on & bit) ? 127 : 0);
+			//if the LEDS are not midi driven, set them
+			if(!(button_midi_led_mask[board] & bit))
+				SetLED(board, index, (on & bit) ? button_color_down[board][index] : button_color_up[board][index]);
+		}
 
-		//debounce
-		for(i = 0; i < 4; i++){
-			uint8_t index = index_mapping(row, i);
-			bool down = (bool)(0x1 & (button_history[board][0] >> index));
-			bool consistent = true;
-			for(j = 1; j < HISTORY; j++){
-				if(down != (bool)(0x1 & (button_history[board][j] >> index))){
-					consistent = false;
-					break;
+		//the shift button, muted and page buttons one at a time after the rest,
+		//they are rare. the row's events are queued before a page change
+		//queues the releases of the buttons held
+		for(index = row * 4, bits = (changed & special) >> index; bits; index++, bits >>= 1){
+			uint16_t bit = (uint16_t)1 << index;
+			if(!(bits & 0x1))
+				continue;
+			//back to the page the shift button was pressed on once it is let go
+			if(board == page_shift_board && index == page_shift_btn){
+				if(!(button_last[board] & bit)){
+					page_shift_board = PAGE_SHIFT_NONE;
+					EventQueue_PushBulk(&midiout_queue, events, num_events);
+					num_events = 0;
+					SetPage(page_shift_return);
 				}
+				continue;
 			}
-			if(consistent){
-				if(down){
-					if(!((button_last[board] >> index) & 0x1)){
-						button_last[board] |= 1 << index;
-						//if we're not in toggle mode just send out data
-						if(!(button_settings[board][index].flags & BTN_TOGGLE)){
-							Buffer_StoreElement(&midiout_buf, 0x80 | button_settings[board][index].chan);
-							Buffer_StoreElement(&midiout_buf, button_settings[board][index].num);
-							Buffer_StoreElement(&midiout_buf, 127);
-							//if the LEDS are not midi driven, set them
-							if(!(button_settings[board][index].flags & BTN_LED_MIDI_DRIVEN)){
-								//clear
-								leds[board][i] &= ~(0x7 << (3 * row));
-								//set
-								leds[board][i] |= (button_settings[board][index].color & 0x7) << (3 * row);
-							}
-							//if we're in toggle mode we have to know the toggle state
-						} else {
-							//swap states
-							button_toggle[board] ^= (uint16_t)(0x1 << index);
-							//down
-							if(button_toggle[board] & (uint16_t)(0x1 << index)){
-								Buffer_StoreElement(&midiout_buf, 0x80 | button_settings[board][index].chan);
-								Buffer_StoreElement(&midiout_buf, button_settings[board][index].num);
-								Buffer_StoreElement(&midiout_buf, 127);
-								//if the LEDS are not midi driven, set them
-								if(!(button_settings[board][index].flags & BTN_LED_MIDI_DRIVEN)){
-									//clear
-									leds[board][i] &= ~(0x7 << (3 * row));
-									//set
-									leds[board][i] |= (button_settings[board][index].color & 0x7) << (3 * row);
-								}
-							} else {
-								//up
-								Buffer_StoreElement(&midiout_buf, 0x80 | button_settings[board][index].chan);
-								Buffer_StoreElement(&midiout_buf, button_settings[board][index].num);
-								Buffer_StoreElement(&midiout_buf, 0);
-								//if the LEDS are not midi driven, set them
-								if(!(button_settings[board][index].flags & BTN_LED_MIDI_DRIVEN)){
-									//clear
-									leds[board][i] &= ~(0x7 << (3 * row));
-									//set
-									leds[board][i] |= ((button_settings[board][index].color >> 3) & 0x7) << (3 * row);
-								}
-							}
-						}
-					}
-				} else {
-					if((button_last[board] >> index) & 0x1){
-						button_last[board] &= ~(1 << index);
-						//in toggle mode we don't do anything on 'up'
-						if(!(button_settings[board][index].flags & BTN_TOGGLE)){
-							Buffer_StoreElement(&midiout_buf, 0x80 | button_settings[board][index].chan);
-							Buffer_StoreElement(&midiout_buf, button_settings[board][index].num);
-							Buffer_StoreElement(&midiout_buf, 0);
-							//if the LEDS are not midi driven, set them
-							if(!(button_settings[board][index].flags & BTN_LED_MIDI_DRIVEN)){
-								//clear
-								leds[board][i] &= ~(0x7 << (3 * row));
-								//set
-								leds[board][i] |= ((button_settings[board][index].color >> 3) & 0x7) << (3 * row);
-							}
-						}
-					}
+			//held through a page change, this is its release
+			if(button_muted[board] & bit){
+				button_muted[board] &= ~bit;
+				continue;
+			}
+			if(button_last[board] & bit){
+				if(!(button_toggle_mask[board] & bit)){
+					page_shift_board = board;
+					page_shift_btn = index;
+					page_shift_return = current_page;
 				}
+				EventQueue_PushBulk(&midiout_queue, events, num_events);
+				num_events = 0;
+				SetPage(button_settings[board][index].num % NUM_PAGES);
 			}
 		}
 	}
 
-	//increment the history index
-	if(row == 3)
-		history = (history + 1) % HISTORY;
+	//a full queue drops whole events
+	EventQueue_PushBulk(&midiout_queue, events, num_events);
 
 	row = (row + 1) % 4;
 	PORTB = (PORTB & 0x0F) | ~(0x10 << row);
+	PROFILE_END(PROFILE_BUTTONS, task_start);
+}
+
+/** Task to write the settings cache back to the eeprom. A byte takes about 3.3ms to write, so rather than
+ *  waiting on the eeprom this writes at most one dirty byte per pass, whenever the last write is done.
+ */
+TASK(EEPROM_Task)
+{
+	uint16_t pos;
+
+	if(!eeprom_is_ready())
+		return;
+
+	//the recall gets an ack of its own
+	if(settings_recall != PRESET_NONE && !settings_flush_ack && !send_ack){
+		if(RecallPreset(settings_recall))
+			send_ack = true;
+		settings_recall = PRESET_NONE;
+		return;
+	}
+
+	if(settings_moving){
+		BeginSettingsWrite();
+		return;
+	}
+
+	//the crc goes out after everything it covers
+	if(!settings_dirty_count){
+		uint16_t crc;
+		if(!settings_crc_stale)
+			return;
+		settings_crc_stale = false;
+		crc = SettingsCRC(&settings_cache);
+		CacheSetting(SETTINGS_CRC_OFFSET, crc & 0xFF);
+		CacheSetting(SETTINGS_CRC_OFFSET + 1, crc >> 8);
+		if(!settings_dirty_count){
+			FinishSettingsWrite();
+			return;
+		}
+	}
+
+	//find the next dirty byte, round robin from the last one written
+	pos = settings_commit_pos;
+	while(!(settings_dirty[pos / 8] & (1 << (pos % 8)))){
+		if(!settings_dirty[pos / 8])
+			pos = (pos | 7) + 1;
+		else
+			pos++;
+		if(pos >= SETTINGS_SIZE)
+			pos = 0;
+	}
+
+	settings_dirty[pos / 8] &= ~(1 << (pos % 8));
+	settings_dirty_count--;
+	eeprom_write_byte((uint8_t *)&settings_slots[settings_slot] + pos, ((uint8_t *)&settings_cache)[pos]);
+	settings_commit_pos = pos;
+
+	if(!settings_dirty_count && !settings_crc_stale)
+		FinishSettingsWrite();
 }
 
 /** Function to manage status updates to the user. This is done via LEDs on the given board, if available, but may be changed to
@@ -594,6 +1901,8 @@ TASK(BUTTONS_Task)
  */
 void UpdateStatus(uint8_t CurrentStatus)
 {
+	//PD6 is a board's ground then, there is no status led
+#if !BOARD_ON_PORT_D
 	//by default turn off the LED
 	PORTD |= _BV(PORTD6);
 
@@ -608,6 +1917,60 @@ void UpdateStatus(uint8_t CurrentStatus)
 			PORTD &= ~_BV(PORTD6);
 			break;
 	}
+#endif
+}
+
+/** Makes room for one more event packet in the selected IN endpoint, handing the current bank to the host
+ *  once it is full. This never waits on the host.
+ *
+ *  \return true if an event packet can be written now, false if every bank is still waiting for the host
+ */
+bool MIDIEventReady(void)
+{
+	if (!(Endpoint_IsINReady())){
+		PROFILE_STALL();
+		return false;
+	}
+
+	/* Hand the bank to the host once it is full, the other bank may be free */
+	if (!(Endpoint_IsReadWriteAllowed())){
+		Endpoint_ClearIN();
+		if (!(Endpoint_IsINReady() && Endpoint_IsReadWriteAllowed())){
+			PROFILE_STALL();
+			return false;
+		}
+	}
+	return true;
+}
+
+/** Writes a single 4 byte USB-MIDI event packet into the selected IN endpoint bank. Packets are collected
+ *  in the bank and only sent once it is full or FlushMIDIEvents() is called, so that one bulk transfer can
+ *  carry up to MIDI_STREAM_EPSIZE / 4 events.
+ *
+ *  \param Header   Packet header, the cable ID in the upper nibble and the code index number in the lower
+ *  \param Byte0    First MIDI byte of the event
+ *  \param Byte1    Second MIDI byte of the event
+ *  \param Byte2    Third MIDI byte of the event
+ *
+ *  \return false if there was no room for the packet, it has to be written again later
+ */
+bool WriteMIDIEvent(const uint8_t Header, const uint8_t Byte0, const uint8_t Byte1, const uint8_t Byte2)
+{
+	if (!MIDIEventReady())
+		return false;
+
+	Endpoint_Write_Byte(Header);
+	Endpoint_Write_Byte(Byte0);
+	Endpoint_Write_Byte(Byte1);
+	Endpoint_Write_Byte(Byte2);
+	return true;
+}
+
+/** Sends any event packets written into the selected IN endpoint bank to the host. */
+void FlushMIDIEvents(void)
+{
+	if (Endpoint_IsINReady() && Endpoint_BytesInEndpoint())
+		Endpoint_ClearIN();
 }
 
 /** Sends a MIDI note change event (note on or off) to the MIDI output jack, on the given virtual cable ID and channel.
@@ -616,111 +1979,65 @@ void UpdateStatus(uint8_t CurrentStatus)
  *  \param OnOff    Set to true if the note is on (being held down), or false otherwise
  *  \param CableID  ID of the virtual cable to send the note change to
  *  \param Channel  MIDI channel number to send the note change event to
+ *
+ *  \return false if the IN endpoint had no room for the event
  */
-void SendMIDINoteChange(const uint8_t Pitch, const bool OnOff, const uint8_t CableID, const uint8_t Channel)
+bool SendMIDINoteChange(const uint8_t Pitch, const bool OnOff, const uint8_t CableID, const uint8_t Channel)
 {
-	/* Wait until endpoint ready for more data */
-	while (!(Endpoint_IsReadWriteAllowed()));
-
 	/* Check if the message should be a Note On or Note Off command */
 	uint8_t Command = ((OnOff)? MIDI_COMMAND_NOTE_ON : MIDI_COMMAND_NOTE_OFF);
 
-	/* Write the Packet Header to the endpoint */
-	Endpoint_Write_Byte((CableID << 4) | (Command >> 4));
-
 	/* Write the Note On/Off command with the specified channel, pitch and velocity */
-	Endpoint_Write_Byte(Command | Channel);
-	Endpoint_Write_Byte(Pitch);
-	Endpoint_Write_Byte(MIDI_STANDARD_VELOCITY);
-
-	/* Send the data in the endpoint to the host */
-	Endpoint_ClearIN();
+	return WriteMIDIEvent((CableID << 4) | (Command >> 4), Command | Channel, Pitch, MIDI_STANDARD_VELOCITY);
 }
 
-void SendMIDICC(const uint8_t num, const uint8_t val, const uint8_t CableID, const uint8_t Channel)
+bool SendMIDICC(const uint8_t num, const uint8_t val, const uint8_t CableID, const uint8_t Channel)
 {
-	/* Wait until endpoint ready for more data */
-	while (!(Endpoint_IsReadWriteAllowed()));
-
-	/* Check if the message should be a Note On or Note Off command */
 	uint8_t Command = MIDI_COMMAND_CC;
 
-	/* Write the Packet Header to the endpoint */
-	Endpoint_Write_Byte((CableID << 4) | (Command >> 4));
-
-	Endpoint_Write_Byte(Command | Channel);
-	Endpoint_Write_Byte(num);
-	Endpoint_Write_Byte(val);
-
-	/* Send the data in the endpoint to the host */
-	Endpoint_ClearIN();
+	return WriteMIDIEvent((CableID << 4) | (Command >> 4), Command | Channel, num, val);
 }
 
-void SendSysex(const uint8_t * buf, const uint8_t len, const uint8_t CableID)
+bool SendSysex(const uint8_t * buf, const uint16_t len, const uint8_t CableID)
 {
 	if(len == 0)
-		return;
-	else if(len == 1){
-		/* Wait until endpoint ready for more data */
-		while (!(Endpoint_IsReadWriteAllowed()));
-		/* Write the Packet Header to the endpoint */
-		Endpoint_Write_Byte((CableID << 4) | 0x7);
-		Endpoint_Write_Byte(SYSEX_BEGIN);
-		Endpoint_Write_Byte(buf[0]);
-		Endpoint_Write_Byte(SYSEX_END);
-		/* Send the data in the endpoint to the host */
-		Endpoint_ClearIN();
-	} else {
+		return true;
+	if(sysex_out_len)
+		return false;
+
+	sysex_out = buf;
+	sysex_out_len = len + 2;
+	sysex_out_pos = 0;
+	sysex_out_cable = CableID;
+	ContinueSysex();
+	return true;
+}
+
+bool ContinueSysex(void)
+{
+	while(sysex_out_pos < sysex_out_len){
+		uint8_t packet[3] = {0, 0, 0};
+		uint16_t left = sysex_out_len - sysex_out_pos;
+		uint8_t cnt = (left > 3) ? 3 : left;
 		uint8_t i;
-		//write the first packet
-		
-		// Wait until endpoint ready for more data
-		while (!(Endpoint_IsReadWriteAllowed()));
-		// Write the Packet Header to the endpoint
-		Endpoint_Write_Byte((CableID << 4) | 0x4);
-		Endpoint_Write_Byte(SYSEX_BEGIN);
-		Endpoint_Write_Byte(buf[0]);
-		Endpoint_Write_Byte(buf[1]);
-		// Send the data in the endpoint to the host
-		Endpoint_ClearIN();
 
-		//write intermediate bytes
-		for(i = 2; (i + 2) < len; i += 3){
-			// Wait until endpoint ready for more data
-			while (!(Endpoint_IsReadWriteAllowed()));
-			// Write the Packet Header to the endpoint
-			Endpoint_Write_Byte((CableID << 4) | 0x4);
-			Endpoint_Write_Byte(buf[i]);
-			Endpoint_Write_Byte(buf[i + 1]);
-			Endpoint_Write_Byte(buf[i + 2]);
-			// Send the data in the endpoint to the host
-			Endpoint_ClearIN();
+		//the message is framed by the begin and end bytes
+		for(i = 0; i < cnt; i++){
+			uint16_t pos = sysex_out_pos + i;
+			if(pos == 0)
+				packet[i] = SYSEX_BEGIN;
+			else if(pos == sysex_out_len - 1)
+				packet[i] = SYSEX_END;
+			else
+				packet[i] = sysex_out[pos - 1];
 		}
 
-		// Wait until endpoint ready for more data
-		while (!(Endpoint_IsReadWriteAllowed()));
-		// Write the Packet Header to the endpoint
-		switch((len - 2) % 3){
-			case 0:
-				Endpoint_Write_Byte((CableID << 4) | 0x5);
-				Endpoint_Write_Byte(SYSEX_END);
-				Endpoint_Write_Byte(0);
-				Endpoint_Write_Byte(0);
-				break;
-			case 1:
-				Endpoint_Write_Byte((CableID << 4) | 0x6);
-				Endpoint_Write_Byte(buf[len - 1]);
-				Endpoint_Write_Byte(SYSEX_END);
-				Endpoint_Write_Byte(0);
-				break;
-			case 2:
-				Endpoint_Write_Byte((CableID << 4) | 0x7);
-				Endpoint_Write_Byte(buf[len - 2]);
-				Endpoint_Write_Byte(buf[len - 1]);
-				Endpoint_Write_Byte(SYSEX_END);
-				break;
-		}
-		// Send the data in the endpoint to the host
-		Endpoint_ClearIN();
+		//0x4 starts or continues a message, 0x5 - 0x7 end it with 1 - 3 bytes
+		if(!WriteMIDIEvent((sysex_out_cable << 4) | ((left > 3) ? 0x4 : 0x4 + cnt),
+					packet[0], packet[1], packet[2]))
+			return false;
+		sysex_out_pos += cnt;
 	}
+	sysex_out_len = 0;
+	return true;
 }
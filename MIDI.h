@@ -37,8 +37,55 @@
 #define _AUDIO_OUTPUT_H_
 
 #define VERSION 1
+//scans a switch has to read the same before its state changes
 #define HISTORY 4
-#define NUM_BOARDS 2
+
+//an eager [BTN_EAGER] switch changes state on the first read that differs and
+//is then ignored for this many ms, at most DEBOUNCE_LOCKOUT_MAX_MS as the
+//window is timed on the 16 bit timer 1
+#define DEBOUNCE_LOCKOUT_MS 10
+#define DEBOUNCE_LOCKOUT_MAX_MS 32
+//the port of each board, in board order. its led column grounds are on the
+//even bits, its switch columns on the odd bits. the row select on the top of
+//PORTB and the led data on PORTA and PORTE are shared by all boards, which
+//leaves ports C, D and F on the at90usb646: at most 3 boards, and a board on
+//port D takes the status led on PD6 with it
+#define BOARD_PORTS(X) X(C) X(F)
+#define BOARD_COUNT(p) + 1
+#define NUM_BOARDS (0 BOARD_PORTS(BOARD_COUNT))
+#define BOARD_IS_D(p) + BOARD_PORT_D_##p
+#define BOARD_PORT_D_C 0
+#define BOARD_PORT_D_D 1
+#define BOARD_PORT_D_F 0
+#define BOARD_ON_PORT_D (0 BOARD_PORTS(BOARD_IS_D))
+//settings presets kept in the eeprom, fewer when the settings of many boards
+//leave no room for this many images [NUM_PRESETS in MIDI.c]
+#define NUM_PRESETS_MAX 8
+//mapping pages held in ram, page 0 is the one kept in the eeprom
+#define NUM_PAGES 4
+//a CC with this channel and number selects the page given by its value
+#define PAGE_CC_CHAN 15
+#define PAGE_CC_NUM 127
+
+//full LED frames per second, each of the NUM_BOARDS * 4 columns is lit in turn
+//from the timer 0 compare interrupt. the column time is rounded down to whole
+//timer ticks, with 2 boards this gives 260Hz and has to be between 66 and 2083
+#define LED_REFRESH_HZ 250
+
+//brightness bits per led color, shown with bit angle modulation
+#define LED_BAM_BITS 4
+
+//events the button scan can queue for the USB task and GET_BUTTON_DATA
+//requests waiting for their reply, each a power of two up to 128
+#define MIDIOUT_QUEUE_SIZE 32
+#define CMD_QUEUE_SIZE 32
+
+//time the tasks and the led interrupt on timer 1, read with GET_STATS. 0
+//compiles all of it out, build with -DPROFILE=1 to measure. it adds to the
+//led interrupt, which runs thousands of times a second
+#ifndef PROFILE
+#define PROFILE 0
+#endif
 
 /* Includes: */
 #include <avr/io.h>
@@ -52,6 +99,8 @@
 #include <LUFA/Drivers/USB/USB.h>                    // USB Functionality
 #include <LUFA/Scheduler/Scheduler.h>                // Simple scheduler for task management
 
+#include "EventQueue.h"
+
 typedef struct {
 	//which midi channel and which cc number
 	uint8_t chan;
@@ -67,9 +116,17 @@ typedef struct {
 #define BTN_LED_MIDI_DRIVEN 0x1
 //otherwise it is momentary
 #define BTN_TOGGLE 0x2
+//send the press/release as soon as it is read instead of debouncing first
+#define BTN_EAGER 0x4
+//selects page num [mod NUM_PAGES] instead of sending midi, while held unless
+//BTN_TOGGLE is set as well
+#define BTN_PAGE 0x8
+//send only the newest value when the host falls behind, instead of every
+//press and release in order
+#define BTN_COALESCE 0x10
 
 //valid flags for encoders
-#define BTN_FLAGS (BTN_LED_MIDI_DRIVEN | BTN_TOGGLE)
+#define BTN_FLAGS (BTN_LED_MIDI_DRIVEN | BTN_TOGGLE | BTN_EAGER | BTN_PAGE | BTN_COALESCE)
 
 /* Macros: */
 /** MIDI command for a note on (activation) event */
@@ -95,7 +152,31 @@ typedef enum {
 	SET_BUTTON_DATA = 2,
 	RET_VERSION = 3,
 	RET_BUTTON_DATA = 4,
-	SYSEX_INVALID = 5
+	GET_LED_TIMING = 5,
+	RET_LED_TIMING = 6,
+	GET_DEBOUNCE = 7,
+	SET_DEBOUNCE = 8,
+	RET_DEBOUNCE = 9,
+	GET_ALL_BUTTON_DATA = 10,
+	SET_ALL_BUTTON_DATA = 11,
+	RET_ALL_BUTTON_DATA = 12,
+	FLUSH_SETTINGS = 13,
+	GET_SETTINGS_STATUS = 14,
+	RET_SETTINGS_STATUS = 15,
+	STORE_PRESET = 16,
+	RECALL_PRESET = 17,
+	LIST_PRESETS = 18,
+	RET_PRESETS = 19,
+	SET_PAGE = 20,
+	GET_PAGE = 21,
+	RET_PAGE = 22,
+	SET_LED_FRAME = 23,
+	GET_STATS = 24,
+	RET_STATS = 25,
+	RESET_STATS = 26,
+	GET_QUEUE_STATS = 27,
+	RET_QUEUE_STATS = 28,
+	SYSEX_INVALID = 29
 } sysex_t;
 
 
@@ -118,7 +199,7 @@ enum MIDI_StatusCodes_t
 /* Task Definitions: */
 TASK(USB_MIDI_Task);
 TASK(BUTTONS_Task);
-TASK(LEDS_Task);
+TASK(EEPROM_Task);
 
 /* Event Handlers: */
 /** Indicates that this module will catch the USB_Connect event when thrown by the library. */
@@ -131,15 +212,40 @@ HANDLES_EVENT(USB_Disconnect);
 HANDLES_EVENT(USB_ConfigurationChanged);
 
 /* Function Prototypes: */
-void SendMIDINoteChange(const uint8_t Pitch, const bool OnOff,
+//none of these wait on the host, they return false when the IN endpoint is full
+
+//event packets are collected in the IN bank until it is full or flushed
+bool MIDIEventReady(void);
+bool WriteMIDIEvent(const uint8_t Header, const uint8_t Byte0,
+		const uint8_t Byte1, const uint8_t Byte2);
+void FlushMIDIEvents(void);
+
+bool SendMIDINoteChange(const uint8_t Pitch, const bool OnOff,
 		const uint8_t CableID, const uint8_t Channel);		
-void SendMIDICC(const uint8_t num, const uint8_t val, 
+bool SendMIDICC(const uint8_t num, const uint8_t val, 
 		const uint8_t CableID, const uint8_t Channel);
 
 //send a sysex message contained in buf
 //automatically adds the beg and end messages to it
-void SendSysex(const uint8_t * buf, const uint8_t len, 
+//buf must stay untouched until the message is sent, ContinueSysex() sends
+//the rest of it and returns true once it is done. returns false if another
+//message is still being sent
+bool SendSysex(const uint8_t * buf, const uint16_t len, 
 		const uint8_t CableID);
+bool ContinueSysex(void);
+
+//fill the GET_LED_TIMING reply from the led interrupt's measurements
+void FillLEDTiming(void);
+
+#if PROFILE
+//fill the GET_STATS reply from the profile counters
+void FillStats(void);
+#endif
+
+#if EVENT_QUEUE_STATS
+//fill the GET_QUEUE_STATS reply from the queues' statistics
+void FillQueueStats(void);
+#endif
 
 void UpdateStatus(uint8_t CurrentStatus);
 
@@ -0,0 +1,583 @@
+/*
+ * Cycle counting benchmark for the LED matrix firmware, run under simavr.
+ *
+ * The real MIDI.elf is loaded and run from reset. simavr has no at90usb646
+ * core, so by default it runs on the atmega644: the same AVR5 instruction
+ * timing, 64K of flash and SRAM starting at 0x100. The harness maps the
+ * at90usb646 registers the firmware relies on into the gaps of that core:
+ * the USB endpoint registers, PLLCSR and PINF. PORTE/PORTF writes land in
+ * plain memory. The interrupt vectors the firmware uses are copied to the
+ * slots of the same interrupts on the atmega644.
+ *
+ * When main() calls USB_Init() the harness injects a call to the
+ * USB_ConfigurationChanged handler, as if the host had enumerated us, and
+ * then plays a few scenarios. For every scenario it reports calls and
+ * min/avg/max cycles of each task and of the LED timer interrupt, the
+ * scheduler pass length, the time between LED interrupts with the resulting
+ * frame rate, and the cycles spent in the USB_MIDI_Task call that consumed
+ * each injected OUT bank.
+ *
+ * usage: MIDI-bench [-m mcu] [-l limits] [-w limits] MIDI.elf MIDI.sym
+ *
+ * A limits file holds "<scenario> <name> <max cycles>" lines. With -l the
+ * run fails when any max exceeds its limit, with -w the current maxima are
+ * written out to seed a new one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_io.h"
+#include "avr_ioport.h"
+
+#define F_CPU 16000000UL
+
+//at90usb646 register addresses (data space)
+#define ADDR_PINF     0x2F
+#define ADDR_PLLCSR   0x49
+#define ADDR_UEINTX   0xE8
+#define ADDR_UENUM    0xE9
+#define ADDR_UESTA0X  0xEE
+#define ADDR_UEDATX   0xF1
+#define ADDR_UEBCLX   0xF2
+#define ADDR_UEBCHX   0xF3
+
+#define ADDR_SPL      0x5D
+#define ADDR_SPH      0x5E
+
+#define UEINTX_TXINI   0
+#define UEINTX_RXOUTI  2
+#define UEINTX_RWAL    5
+#define UEINTX_FIFOCON 7
+
+#define MIDI_STREAM_OUT_EPNUM 1
+#define MIDI_STREAM_IN_EPNUM  2
+#define EPSIZE 64
+
+#define BOOT_CYCLE_LIMIT 100000000ULL
+#define SCENARIO_CYCLE_LIMIT 200000000ULL
+
+//at90usb646 vector numbers and where the same interrupt sits on the atmega644
+#define VECTOR_TIMER0_COMPA 21
+#define VECTOR_TIMER0_COMPA_644 16
+
+//the board ports and led bitplanes of the firmware, passed in from MIDI.h by
+//the makefile
+#if !defined(BOARD_PORTS) || !defined(LED_BAM_BITS)
+#error build with the BOARD_PORTS and LED_BAM_BITS of MIDI.h, see the makefile
+#endif
+#define BOARD_COUNT(p) + 1
+#define NUM_BOARDS (0 BOARD_PORTS(BOARD_COUNT))
+#define BOARD_PORT_NAME(p) #p
+//columns scanned per LED frame, 4 per board
+#define LED_COLUMNS (NUM_BOARDS * 4)
+
+enum {
+	FN_LED_ISR,
+	FN_BUTTONS,
+	FN_USB_MIDI,
+	FN_PASS,
+	FN_LED_PERIOD,
+	FN_OUT_BANK,
+	FN_COUNT
+};
+
+static const char * fn_names[FN_COUNT] = {
+	"led_isr", "BUTTONS_Task", "USB_MIDI_Task", "pass", "led_period", "out_bank"
+};
+
+typedef struct {
+	uint32_t calls;
+	avr_cycle_count_t min;
+	avr_cycle_count_t max;
+	avr_cycle_count_t total;
+} stat_t;
+
+typedef struct {
+	uint32_t entry;
+	int active;
+	uint16_t entry_sp;
+	avr_cycle_count_t start;
+} tracker_t;
+
+static avr_t * avr;
+static stat_t stats[FN_COUNT];
+static tracker_t trackers[FN_USB_MIDI + 1];
+static uint32_t addr_config_changed;
+static uint32_t addr_usb_init;
+static avr_cycle_count_t last_pass_start;
+static avr_cycle_count_t last_led_start;
+static uint32_t passes;
+static uint32_t led_interrupts;
+
+//fake endpoints
+static uint8_t cur_ep;
+static uint8_t out_bank[EPSIZE];
+static uint8_t out_count;
+static uint8_t out_pos;
+static uint8_t out_pending[4096];
+static uint16_t out_pending_count;
+static int out_bank_cleared;
+static uint8_t in_count;
+static uint32_t in_transfers;
+
+static uint8_t pinf;
+
+static void stat_add(stat_t * s, avr_cycle_count_t cycles)
+{
+	if (!s->calls || cycles < s->min)
+		s->min = cycles;
+	if (cycles > s->max)
+		s->max = cycles;
+	s->total += cycles;
+	s->calls++;
+}
+
+static void load_out_bank(void)
+{
+	out_pos = 0;
+	out_count = out_pending_count > EPSIZE ? EPSIZE : out_pending_count;
+	memcpy(out_bank, out_pending, out_count);
+	memmove(out_pending, out_pending + out_count, out_pending_count - out_count);
+	out_pending_count -= out_count;
+}
+
+static uint8_t ueintx_read(avr_t * a, avr_io_addr_t addr, void * param)
+{
+	uint8_t v = (1 << UEINTX_FIFOCON);
+	(void)a; (void)addr; (void)param;
+
+	if (cur_ep == MIDI_STREAM_IN_EPNUM) {
+		//the host always has a bank free for us
+		v |= (1 << UEINTX_TXINI);
+		if (in_count < EPSIZE)
+			v |= (1 << UEINTX_RWAL);
+	} else if (cur_ep == MIDI_STREAM_OUT_EPNUM && out_count) {
+		v |= (1 << UEINTX_RXOUTI);
+		if (out_pos < out_count)
+			v |= (1 << UEINTX_RWAL);
+	}
+	return v;
+}
+
+static void ueintx_write(avr_t * a, avr_io_addr_t addr, uint8_t v, void * param)
+{
+	(void)a; (void)addr; (void)param;
+
+	if (v & (1 << UEINTX_FIFOCON))
+		return;
+	if (cur_ep == MIDI_STREAM_IN_EPNUM) {
+		in_transfers++;
+		in_count = 0;
+	} else if (cur_ep == MIDI_STREAM_OUT_EPNUM && out_count) {
+		out_bank_cleared = 1;
+		load_out_bank();
+	}
+}
+
+static uint8_t uenum_read(avr_t * a, avr_io_addr_t addr, void * param)
+{
+	(void)a; (void)addr; (void)param;
+	return cur_ep;
+}
+
+static void uenum_write(avr_t * a, avr_io_addr_t addr, uint8_t v, void * param)
+{
+	(void)a; (void)addr; (void)param;
+	cur_ep = v & 0x7;
+}
+
+static uint8_t uedatx_read(avr_t * a, avr_io_addr_t addr, void * param)
+{
+	(void)a; (void)addr; (void)param;
+	if (cur_ep == MIDI_STREAM_OUT_EPNUM && out_pos < out_count)
+		return out_bank[out_pos++];
+	return 0;
+}
+
+static void uedatx_write(avr_t * a, avr_io_addr_t addr, uint8_t v, void * param)
+{
+	(void)a; (void)addr; (void)v; (void)param;
+	if (cur_ep == MIDI_STREAM_IN_EPNUM && in_count < EPSIZE)
+		in_count++;
+}
+
+static uint8_t uebclx_read(avr_t * a, avr_io_addr_t addr, void * param)
+{
+	(void)a; (void)addr; (void)param;
+	if (cur_ep == MIDI_STREAM_IN_EPNUM)
+		return in_count;
+	if (cur_ep == MIDI_STREAM_OUT_EPNUM)
+		return out_count - out_pos;
+	return 0;
+}
+
+static uint8_t zero_read(avr_t * a, avr_io_addr_t addr, void * param)
+{
+	(void)a; (void)addr; (void)param;
+	return 0;
+}
+
+static uint8_t uesta0x_read(avr_t * a, avr_io_addr_t addr, void * param)
+{
+	(void)a; (void)addr; (void)param;
+	//CFGOK, every endpoint configuration succeeds
+	return 0x80;
+}
+
+static uint8_t pllcsr_read(avr_t * a, avr_io_addr_t addr, void * param)
+{
+	(void)a; (void)addr; (void)param;
+	//PLOCK, the PLL is always locked
+	return 0x01;
+}
+
+static uint8_t pinf_read(avr_t * a, avr_io_addr_t addr, void * param)
+{
+	(void)a; (void)addr; (void)param;
+	return pinf;
+}
+
+//switch inputs sit on the odd pins of each board's port, low when pressed.
+//the atmega644 has no port F, PINF is served by pinf_read
+static void set_switches(int pressed)
+{
+	static const char ports[] = BOARD_PORTS(BOARD_PORT_NAME);
+	int b;
+	int i;
+
+	for (b = 0; b < NUM_BOARDS; b++) {
+		if (ports[b] == 'F') {
+			pinf = pressed ? 0x00 : 0xAA;
+			continue;
+		}
+		for (i = 1; i < 8; i += 2)
+			avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(ports[b]), i), pressed ? 0 : 1);
+	}
+}
+
+static uint16_t get_sp(void)
+{
+	return avr->data[ADDR_SPL] | (avr->data[ADDR_SPH] << 8);
+}
+
+//make the cpu call addr as if the current instruction was a call to it
+static void inject_call(uint32_t addr)
+{
+	uint16_t sp = get_sp();
+	uint32_t ret = avr->pc >> 1;
+
+	avr->data[sp] = ret & 0xFF;
+	avr->data[sp - 1] = (ret >> 8) & 0xFF;
+	sp -= 2;
+	avr->data[ADDR_SPL] = sp & 0xFF;
+	avr->data[ADDR_SPH] = sp >> 8;
+	avr->pc = addr;
+}
+
+//execute one instruction, keeping track of the measured functions
+static int step(void)
+{
+	int i;
+	int state;
+
+	for (i = 0; i <= FN_USB_MIDI; i++) {
+		tracker_t * t = &trackers[i];
+		if (!t->active && avr->pc == t->entry) {
+			t->active = 1;
+			t->entry_sp = get_sp();
+			t->start = avr->cycle;
+			if (i == FN_BUTTONS) {
+				if (passes)
+					stat_add(&stats[FN_PASS], avr->cycle - last_pass_start);
+				last_pass_start = avr->cycle;
+				passes++;
+			} else if (i == FN_LED_ISR) {
+				if (led_interrupts % LED_BAM_BITS == 0) {
+					if (led_interrupts)
+						stat_add(&stats[FN_LED_PERIOD], avr->cycle - last_led_start);
+					last_led_start = avr->cycle;
+				}
+				led_interrupts++;
+			} else if (i == FN_USB_MIDI) {
+				out_bank_cleared = 0;
+			}
+		}
+	}
+
+	state = avr_run(avr);
+
+	for (i = 0; i <= FN_USB_MIDI; i++) {
+		tracker_t * t = &trackers[i];
+		if (t->active && get_sp() > t->entry_sp) {
+			t->active = 0;
+			stat_add(&stats[i], avr->cycle - t->start);
+			if (i == FN_USB_MIDI && out_bank_cleared)
+				stat_add(&stats[FN_OUT_BANK], avr->cycle - t->start);
+		}
+	}
+	return state;
+}
+
+static int run_passes(uint32_t count)
+{
+	uint32_t target = passes + count;
+	avr_cycle_count_t limit = avr->cycle + SCENARIO_CYCLE_LIMIT;
+
+	while (passes < target) {
+		int state = step();
+		if (state == cpu_Done || state == cpu_Crashed || avr->cycle > limit)
+			return -1;
+	}
+	return 0;
+}
+
+static void queue_out(const uint8_t * bytes, uint16_t len)
+{
+	if (out_pending_count + len > sizeof(out_pending))
+		return;
+	memcpy(out_pending + out_pending_count, bytes, len);
+	out_pending_count += len;
+	if (!out_count)
+		load_out_bank();
+}
+
+/* Limits */
+
+typedef struct {
+	char scenario[32];
+	char name[32];
+	unsigned long max;
+} limit_t;
+
+static limit_t limits[64];
+static int num_limits;
+static FILE * limits_out;
+static int failed;
+
+static void read_limits(const char * path)
+{
+	FILE * f = fopen(path, "r");
+	char line[128];
+
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f) && num_limits < 64) {
+		limit_t * l = &limits[num_limits];
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%31s %31s %lu", l->scenario, l->name, &l->max) == 3)
+			num_limits++;
+	}
+	fclose(f);
+}
+
+static void report(const char * scenario)
+{
+	int i;
+	int j;
+
+	printf("%s\n", scenario);
+	printf("  %-14s %8s %8s %8s %8s\n", "", "calls", "min", "avg", "max");
+	for (i = 0; i < FN_COUNT; i++) {
+		stat_t * s = &stats[i];
+		if (!s->calls)
+			continue;
+		printf("  %-14s %8u %8llu %8llu %8llu\n", fn_names[i], s->calls,
+				(unsigned long long)s->min,
+				(unsigned long long)(s->total / s->calls),
+				(unsigned long long)s->max);
+		if (limits_out)
+			fprintf(limits_out, "%s %s %llu\n", scenario, fn_names[i], (unsigned long long)s->max);
+		for (j = 0; j < num_limits; j++) {
+			if (!strcmp(limits[j].scenario, scenario) && !strcmp(limits[j].name, fn_names[i]) &&
+					s->max > limits[j].max) {
+				printf("  FAIL %s max %llu > limit %lu\n", fn_names[i],
+						(unsigned long long)s->max, limits[j].max);
+				failed = 1;
+			}
+		}
+	}
+	if (stats[FN_LED_PERIOD].calls) {
+		unsigned long avg = stats[FN_LED_PERIOD].total / stats[FN_LED_PERIOD].calls;
+		printf("  led frame rate %lu Hz avg, %lu Hz worst, jitter %llu cycles\n",
+				(unsigned long)(F_CPU / (avg * LED_COLUMNS)),
+				(unsigned long)(F_CPU / (stats[FN_LED_PERIOD].max * LED_COLUMNS)),
+				(unsigned long long)(stats[FN_LED_PERIOD].max - stats[FN_LED_PERIOD].min));
+	}
+	memset(stats, 0, sizeof(stats));
+}
+
+/* Symbols */
+
+static uint32_t find_symbol(const char * path, const char * name)
+{
+	FILE * f = fopen(path, "r");
+	char line[256];
+	uint32_t addr = 0;
+
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long a;
+		char type;
+		char sym[200];
+		if (sscanf(line, "%lx %c %199s", &a, &type, sym) == 3 && !strcmp(sym, name)) {
+			addr = a;
+			break;
+		}
+	}
+	fclose(f);
+	if (!addr) {
+		fprintf(stderr, "%s: no symbol %s\n", path, name);
+		exit(1);
+	}
+	return addr;
+}
+
+//point a vector of the simulated core at the handler of a firmware vector
+static void remap_vector(int from, int to)
+{
+	//both cores use 4 byte jmp vectors
+	memcpy(avr->flash + to * 4, avr->flash + from * 4, 4);
+}
+
+static void usage(const char * prog)
+{
+	fprintf(stderr, "usage: %s [-m mcu] [-l limits] [-w limits] MIDI.elf MIDI.sym\n", prog);
+	exit(1);
+}
+
+int main(int argc, char * argv[])
+{
+	const char * mcu = "atmega644";
+	const char * limits_path = NULL;
+	const char * write_path = NULL;
+	elf_firmware_t firmware;
+	uint32_t i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:l:w:")) != -1) {
+		switch (opt) {
+			case 'm':
+				mcu = optarg;
+				break;
+			case 'l':
+				limits_path = optarg;
+				break;
+			case 'w':
+				write_path = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2)
+		usage(argv[0]);
+
+	memset(&firmware, 0, sizeof(firmware));
+	if (elf_read_firmware(argv[optind], &firmware)) {
+		fprintf(stderr, "%s: could not load\n", argv[optind]);
+		return 1;
+	}
+	avr = avr_make_mcu_by_name(mcu);
+	if (!avr) {
+		fprintf(stderr, "no simavr core for %s\n", mcu);
+		return 1;
+	}
+	avr_init(avr);
+	avr->frequency = F_CPU;
+	avr_load_firmware(avr, &firmware);
+
+	//TIMER0_COMPA_vect on the at90usb646
+	trackers[FN_LED_ISR].entry = find_symbol(argv[optind + 1], "__vector_21");
+	trackers[FN_BUTTONS].entry = find_symbol(argv[optind + 1], "BUTTONS_Task");
+	trackers[FN_USB_MIDI].entry = find_symbol(argv[optind + 1], "USB_MIDI_Task");
+	addr_config_changed = find_symbol(argv[optind + 1], "Event_USB_ConfigurationChanged");
+	addr_usb_init = find_symbol(argv[optind + 1], "USB_Init");
+	if (!strcmp(mcu, "atmega644"))
+		remap_vector(VECTOR_TIMER0_COMPA, VECTOR_TIMER0_COMPA_644);
+
+	avr_register_io_read(avr, ADDR_UEINTX, ueintx_read, NULL);
+	avr_register_io_write(avr, ADDR_UEINTX, ueintx_write, NULL);
+	avr_register_io_read(avr, ADDR_UENUM, uenum_read, NULL);
+	avr_register_io_write(avr, ADDR_UENUM, uenum_write, NULL);
+	avr_register_io_read(avr, ADDR_UEDATX, uedatx_read, NULL);
+	avr_register_io_write(avr, ADDR_UEDATX, uedatx_write, NULL);
+	avr_register_io_read(avr, ADDR_UEBCLX, uebclx_read, NULL);
+	avr_register_io_read(avr, ADDR_UEBCHX, zero_read, NULL);
+	avr_register_io_read(avr, ADDR_UESTA0X, uesta0x_read, NULL);
+	avr_register_io_read(avr, ADDR_PLLCSR, pllcsr_read, NULL);
+	avr_register_io_read(avr, ADDR_PINF, pinf_read, NULL);
+	set_switches(0);
+
+	//boot up to USB_Init(), the scheduler starts right after it
+	while (avr->pc != addr_usb_init) {
+		int state = avr_run(avr);
+		if (state == cpu_Done || state == cpu_Crashed || avr->cycle > BOOT_CYCLE_LIMIT) {
+			fprintf(stderr, "firmware never reached the scheduler\n");
+			return 1;
+		}
+	}
+	printf("boot %llu cycles\n", (unsigned long long)avr->cycle);
+	inject_call(addr_config_changed);
+
+	if (limits_path)
+		read_limits(limits_path);
+	if (write_path && !(limits_out = fopen(write_path, "w"))) {
+		perror(write_path);
+		return 1;
+	}
+
+	if (run_passes(1000))
+		goto stuck;
+	report("idle");
+
+	set_switches(1);
+	if (run_passes(100))
+		goto stuck;
+	set_switches(0);
+	if (run_passes(100))
+		goto stuck;
+	report("buttons");
+
+	for (i = 0; i < 100; i++) {
+		const uint8_t cc[4] = {0x0B, 0xB0, i & 0x1F, i & 0x7};
+		queue_out(cc, sizeof(cc));
+		if (run_passes(4))
+			goto stuck;
+	}
+	report("cc");
+
+	for (i = 0; i < 32; i++) {
+		//F0 header SET_BUTTON_DATA index chan num flags color F7
+		const uint8_t sysex[20] = {
+			0x04, 0xF0, 0x7D, 0x62,
+			0x04, 0x75, 0x7A, 0x7A,
+			0x04, 0x72, 0x01, 0x02,
+			0x04, i, 0x00, i,
+			0x07, 0x00, 0x3F, 0xF7
+		};
+		queue_out(sysex, sizeof(sysex));
+		if (run_passes(8))
+			goto stuck;
+	}
+	report("set_button_data");
+
+	if (limits_out)
+		fclose(limits_out);
+	return failed;
+
+stuck:
+	fprintf(stderr, "firmware stopped making scheduler passes at cycle %llu, pc 0x%x\n",
+			(unsigned long long)avr->cycle, avr->pc);
+	return 1;
+}
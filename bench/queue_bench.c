@@ -0,0 +1,173 @@
+/*
+ * Host microbenchmark of the button to USB event handoff: the byte RingBuff
+ * the firmware used to carry CCs in, three bytes per event, against the
+ * EventQueue of whole events, one at a time and in bulk.
+ *
+ * Each round the producer queues a burst of events, as a scan pass does, and
+ * the consumer takes them all, as the USB task does. The time per event is
+ * reported for each. On the host the RingBuff atomic blocks compile to
+ * nothing, so its cost on the AVR is understated here.
+ *
+ * A second run overfills both queues, with the consumer taking a burst only
+ * every other round. It counts the events that come out, the ones that come
+ * out corrupted and, for the RingBuff, the bytes of events it dropped part
+ * of that the consumer had to skip.
+ *
+ * usage: queue-bench [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "RingBuff.h"
+#include "EventQueue.h"
+
+#define BURST 8
+
+static double Now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static midi_event_t MakeEvent(unsigned long i)
+{
+	midi_event_t ev;
+
+	ev.chan = i & 0x0F;
+	ev.num = (i >> 4) & 0x7F;
+	ev.val = (i & 1) ? 127 : 0;
+	return ev;
+}
+
+//an event is intact when its fields are consistent with each other
+static int Intact(const midi_event_t * ev)
+{
+	return (ev->val == 127) == (ev->chan & 1) && (ev->val == 0 || ev->val == 127);
+}
+
+/* RingBuff: */
+
+static RingBuff_t ring;
+//bytes the consumer threw away to get back in step
+static unsigned long ring_skipped;
+
+static void RingPush(const midi_event_t * ev)
+{
+	Buffer_StoreElement(&ring, 0x80 | ev->chan);
+	Buffer_StoreElement(&ring, ev->num);
+	Buffer_StoreElement(&ring, ev->val);
+}
+
+//the consumer loop MIDI.c had: resync on the top bit of the channel byte
+static unsigned RingPop(midi_event_t * ev, unsigned max)
+{
+	unsigned n = 0;
+
+	while (n < max && ring.Elements > 2) {
+		uint8_t chan = Buffer_GetElement(&ring);
+		if (chan & 0x80) {
+			ev[n].chan = chan & 0x0F;
+			ev[n].num = Buffer_GetElement(&ring) & 0x7F;
+			ev[n].val = Buffer_GetElement(&ring) & 0x7F;
+			n++;
+		} else
+			ring_skipped++;
+	}
+	return n;
+}
+
+/* Runs: */
+
+typedef enum { RUN_RING, RUN_QUEUE, RUN_QUEUE_BULK } run_t;
+
+static const char * run_names[] = { "RingBuff", "EventQueue", "EventQueue bulk" };
+
+//as big as the firmware's midiout_queue
+#define QUEUE_SIZE 32
+
+static midi_event_t queue_events[QUEUE_SIZE];
+static EventQueue_t queue;
+
+//one round: a burst in, then a burst out unless the consumer skips it
+static unsigned Round(run_t run, unsigned long base, int consume, unsigned long * sum, unsigned long * corrupt)
+{
+	midi_event_t in[BURST];
+	midi_event_t out[BURST];
+	unsigned i, n = 0;
+
+	for (i = 0; i < BURST; i++)
+		in[i] = MakeEvent(base + i);
+
+	switch (run) {
+		case RUN_RING:
+			for (i = 0; i < BURST; i++)
+				RingPush(&in[i]);
+			if (consume)
+				n = RingPop(out, BURST);
+			break;
+		case RUN_QUEUE:
+			for (i = 0; i < BURST; i++)
+				EventQueue_Push(&queue, &in[i]);
+			if (consume) {
+				while (n < BURST && EventQueue_Pop(&queue, &out[n]))
+					n++;
+			}
+			break;
+		case RUN_QUEUE_BULK:
+			EventQueue_PushBulk(&queue, in, BURST);
+			if (consume)
+				n = EventQueue_PopBulk(&queue, out, BURST);
+			break;
+	}
+
+	for (i = 0; i < n; i++) {
+		*sum += out[i].chan + out[i].num + out[i].val;
+		if (!Intact(&out[i]))
+			(*corrupt)++;
+	}
+	return n;
+}
+
+static void Reset(void)
+{
+	Buffer_Initialize(&ring);
+	EventQueue_Init(&queue, queue_events, QUEUE_SIZE);
+	ring_skipped = 0;
+}
+
+int main(int argc, char ** argv)
+{
+	unsigned long rounds = (argc > 1) ? strtoul(argv[1], NULL, 0) : 1000000;
+	unsigned long sum = 0;
+	int run;
+
+	printf("%lu rounds of %u events\n", rounds, BURST);
+	for (run = RUN_RING; run <= RUN_QUEUE_BULK; run++) {
+		unsigned long r, events = 0, corrupt = 0;
+		double start;
+
+		Reset();
+		start = Now();
+		for (r = 0; r < rounds; r++)
+			events += Round(run, r * BURST, 1, &sum, &corrupt);
+		printf("  %-16s %6.2f ns/event\n", run_names[run], (Now() - start) / events);
+	}
+
+	printf("overfilled, consumer every other round\n");
+	for (run = RUN_RING; run <= RUN_QUEUE_BULK; run++) {
+		unsigned long r, events = 0, corrupt = 0;
+
+		Reset();
+		for (r = 0; r < rounds; r++)
+			events += Round(run, r * BURST, r & 1, &sum, &corrupt);
+		printf("  %-16s %lu of %lu events out, %lu corrupted, %lu bytes skipped\n",
+				run_names[run], events, rounds * BURST, corrupt, ring_skipped);
+	}
+
+	//keep the work from being optimized away
+	return sum == 42;
+}
@@ -6,38 +6,47 @@ SYSEX_HEADER = [125, 98, 117, 122, 122, 114, 1]
 SYSEX_BEGIN = 0xF0
 SYSEX_END = 0xF7
 
-SET_BUTTON_DATA = 2
+SET_ALL_BUTTON_DATA = 11
 
 BTN_LED_MIDI_DRIVEN = 0x1
 BTN_TOGGLE = 0x2
+BTN_EAGER = 0x4
+BTN_PAGE = 0x8
+BTN_COALESCE = 0x10
+
+#the whole table in one message: chan, num, flags, color of every button
+data = []
+(NUM_BOARDS * 16).times do |i|
+  #chan
+  data << 0
+  #cc num
+  data << i
+  #flag
+  flags = 0
+  data << flags
+  #color
+  color = 0
+  if i % 2 == 0
+    color = ((1 << 2) | (1 << 1)) << 3
+    color = color | 1
+  else
+    color = ((1 << 2)) << 3
+    color = color | (1 << 1)
+  end
+  data << color
+end
+#makes the sum of the data and the checksum 0 [mod 128]
+checksum = (-data.inject(0){ |s, b| s + b }) & 0x7F
 
 File.open(SYSEX_FILE, "w"){ |f|
-  #buttons
-  (NUM_BOARDS * 16).times do |i|
-    f.print SYSEX_BEGIN.chr
-    SYSEX_HEADER.each do |h|
-      f.print h.chr
-    end
-    f.print SET_BUTTON_DATA.chr
-    #index
-    f.print i.chr
-    #chan
-    f.print 0.chr
-    #cc num
-    f.print i.chr
-    #flag
-    flags = 0
-    f.print flags.chr
-    #color
-    color = 0
-    if i % 2 == 0
-      color = ((1 << 2) | (1 << 1)) << 3
-      color = color | 1
-    else
-      color = ((1 << 2)) << 3
-      color = color | (1 << 1)
-    end
-    f.print color.chr
-    f.print SYSEX_END.chr
+  f.print SYSEX_BEGIN.chr
+  SYSEX_HEADER.each do |h|
+    f.print h.chr
+  end
+  f.print SET_ALL_BUTTON_DATA.chr
+  data.each do |b|
+    f.print b.chr
   end
+  f.print checksum.chr
+  f.print SYSEX_END.chr
 }
@@ -0,0 +1,13 @@
+/* Host-side stand-in for <LUFA/Common/Common.h>, used by the simulator build. */
+
+#ifndef _SIM_LUFA_COMMON_H_
+#define _SIM_LUFA_COMMON_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ATTR_WARN_UNUSED_RESULT  __attribute__ ((warn_unused_result))
+#define ATTR_NON_NULL_PTR_ARG(...) __attribute__ ((nonnull (__VA_ARGS__)))
+#define ATTR_ALWAYS_INLINE       __attribute__ ((always_inline))
+
+#endif
@@ -0,0 +1,89 @@
+/*
+ * Host-side stand-in for the LUFA 090510 USB driver, used by the simulator
+ * build. Only the pieces the firmware touches are modelled: the event
+ * handler macros, the descriptor types Descriptors.h builds on and the
+ * endpoint calls, which are backed by the fake endpoint banks in sim.c.
+ */
+
+#ifndef _SIM_LUFA_USB_H_
+#define _SIM_LUFA_USB_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <LUFA/Common/Common.h>
+
+/* Events: */
+#define EVENT_HANDLER(e)   void Event_ ## e (void)
+#define HANDLES_EVENT(e)   EVENT_HANDLER(e)
+#define RAISE_EVENT(e)     Event_ ## e ()
+
+/* Descriptors: */
+typedef struct
+{
+	uint8_t Size;
+	uint8_t Type;
+} USB_Descriptor_Header_t;
+
+typedef struct
+{
+	USB_Descriptor_Header_t Header;
+	uint16_t TotalConfigurationSize;
+	uint8_t  TotalInterfaces;
+	uint8_t  ConfigurationNumber;
+	uint8_t  ConfigurationStrIndex;
+	uint8_t  ConfigAttributes;
+	uint8_t  MaxPowerConsumption;
+} USB_Descriptor_Configuration_Header_t;
+
+typedef struct
+{
+	USB_Descriptor_Header_t Header;
+	uint8_t InterfaceNumber;
+	uint8_t AlternateSetting;
+	uint8_t TotalEndpoints;
+	uint8_t Class;
+	uint8_t SubClass;
+	uint8_t Protocol;
+	uint8_t InterfaceStrIndex;
+} USB_Descriptor_Interface_t;
+
+typedef struct
+{
+	USB_Descriptor_Header_t Header;
+	uint8_t  EndpointAddress;
+	uint8_t  Attributes;
+	uint16_t EndpointSize;
+	uint8_t  PollingIntervalMS;
+} USB_Descriptor_Endpoint_t;
+
+/* Endpoints: */
+#define EP_TYPE_CONTROL        0
+#define EP_TYPE_ISOCHRONOUS    1
+#define EP_TYPE_BULK           2
+#define EP_TYPE_INTERRUPT      3
+
+#define ENDPOINT_DIR_OUT       0
+#define ENDPOINT_DIR_IN        1
+
+#define ENDPOINT_BANK_SINGLE   1
+#define ENDPOINT_BANK_DOUBLE   2
+
+bool Endpoint_ConfigureEndpoint(const uint8_t Number, const uint8_t Type,
+		const uint8_t Direction, const uint16_t Size, const uint8_t Banks);
+void     Endpoint_SelectEndpoint(const uint8_t EndpointNumber);
+uint8_t  Endpoint_GetCurrentEndpoint(void);
+bool     Endpoint_IsINReady(void);
+bool     Endpoint_IsOUTReceived(void);
+bool     Endpoint_IsReadWriteAllowed(void);
+uint16_t Endpoint_BytesInEndpoint(void);
+uint8_t  Endpoint_Read_Byte(void);
+void     Endpoint_Write_Byte(const uint8_t Byte);
+void     Endpoint_ClearIN(void);
+void     Endpoint_ClearOUT(void);
+
+/* Management: */
+void USB_Init(void);
+void USB_USBTask(void);
+
+#endif
@@ -0,0 +1,39 @@
+/*
+ * Host-side stand-in for the LUFA 090510 scheduler, used by the simulator
+ * build. The task list layout matches the real one, Scheduler_Start() hands
+ * over to the simulator, which runs the passes while it plays its script.
+ */
+
+#ifndef _SIM_LUFA_SCHEDULER_H_
+#define _SIM_LUFA_SCHEDULER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TASK(name) void name (void)
+
+#define TASK_LIST   extern TaskEntry_t Scheduler_TaskList[]; TaskEntry_t Scheduler_TaskList[] =
+
+#define TOTAL_TASKS (sizeof(Scheduler_TaskList) / sizeof(TaskEntry_t))
+
+#define TASK_RUN  true
+#define TASK_STOP false
+
+typedef void (*TaskPtr_t)(void);
+
+typedef struct
+{
+	TaskPtr_t Task;
+	bool      TaskStatus;
+} TaskEntry_t;
+
+extern TaskEntry_t Scheduler_TaskList[];
+extern volatile uint8_t Scheduler_TotalTasks;
+
+void Scheduler_SetTaskMode(const TaskPtr_t Task, const bool TaskStatus);
+
+#define Scheduler_Init() do { Scheduler_TotalTasks = TOTAL_TASKS; } while (0)
+
+void Scheduler_Start(void) __attribute__ ((noreturn));
+
+#endif
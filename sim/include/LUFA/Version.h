@@ -0,0 +1,8 @@
+/* Host-side stand-in for <LUFA/Version.h>, used by the simulator build. */
+
+#ifndef _SIM_LUFA_VERSION_H_
+#define _SIM_LUFA_VERSION_H_
+
+#define LUFA_VERSION_STRING "090510-sim"
+
+#endif
@@ -0,0 +1,29 @@
+/*
+ * Host-side stand-in for <avr/eeprom.h>, used by the simulator build.
+ *
+ * EEMEM variables are ordinary host globals so the accessors just go through
+ * the pointer. Every access is counted, and a write keeps the EEPROM busy for
+ * SIM_EEPROM_WRITE_TICKS simulator ticks like the real 3.3ms write cycle.
+ */
+
+#ifndef _SIM_AVR_EEPROM_H_
+#define _SIM_AVR_EEPROM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define EEMEM
+
+uint8_t Sim_EEPROM_IsReady(void);
+void Sim_EEPROM_BusyWait(void);
+uint8_t Sim_EEPROM_ReadByte(const uint8_t * addr);
+void Sim_EEPROM_WriteByte(uint8_t * addr, uint8_t value);
+void Sim_EEPROM_ReadBlock(void * dst, const void * src, size_t n);
+
+#define eeprom_is_ready() Sim_EEPROM_IsReady()
+#define eeprom_busy_wait() Sim_EEPROM_BusyWait()
+#define eeprom_read_byte(addr) Sim_EEPROM_ReadByte((const uint8_t *)(addr))
+#define eeprom_write_byte(addr, value) Sim_EEPROM_WriteByte((uint8_t *)(addr), (value))
+#define eeprom_read_block(dst, src, n) Sim_EEPROM_ReadBlock((dst), (src), (n))
+
+#endif
@@ -0,0 +1,10 @@
+/* Host-side stand-in for <avr/interrupt.h>, used by the simulator build. */
+
+#ifndef _SIM_AVR_INTERRUPT_H_
+#define _SIM_AVR_INTERRUPT_H_
+
+#define sei()
+#define cli()
+#define ISR(vector) void vector (void)
+
+#endif
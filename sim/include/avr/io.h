@@ -0,0 +1,42 @@
+/*
+ * Host-side stand-in for <avr/io.h>, used by the simulator build.
+ *
+ * The ports, data direction and timer control registers are plain bytes.
+ * The pin registers are set from the simulated switch matrix before every
+ * task call, and timer 1 is computed from the simulator clock on every read.
+ */
+
+#ifndef _SIM_AVR_IO_H_
+#define _SIM_AVR_IO_H_
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+//last eeprom address of the at90usb646
+#define E2END 0x7FF
+
+extern volatile uint8_t PORTA, PORTB, PORTC, PORTD, PORTE, PORTF;
+extern volatile uint8_t DDRA, DDRB, DDRC, DDRD, DDRE, DDRF;
+extern volatile uint8_t PINA, PINB, PINC, PIND, PINE, PINF;
+extern volatile uint8_t MCUSR;
+extern volatile uint8_t TCCR0A, TCCR0B, OCR0A, TIMSK0;
+extern volatile uint8_t TCCR1A, TCCR1B;
+
+uint16_t Sim_ReadTimer1(void);
+
+#define TCNT1 Sim_ReadTimer1()
+
+#define CS00   0
+#define CS01   1
+#define CS02   2
+#define WGM01  1
+#define OCIE0A 1
+#define CS10   0
+#define CS11   1
+#define CS12   2
+
+#define WDRF 3
+#define PORTD6 6
+
+#endif
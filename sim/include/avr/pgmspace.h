@@ -0,0 +1,12 @@
+/* Host-side stand-in for <avr/pgmspace.h>, used by the simulator build. */
+
+#ifndef _SIM_AVR_PGMSPACE_H_
+#define _SIM_AVR_PGMSPACE_H_
+
+#include <stdint.h>
+
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+
+#endif
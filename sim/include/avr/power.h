@@ -0,0 +1,9 @@
+/* Host-side stand-in for <avr/power.h>, used by the simulator build. */
+
+#ifndef _SIM_AVR_POWER_H_
+#define _SIM_AVR_POWER_H_
+
+#define clock_div_1 0
+#define clock_prescale_set(div) ((void)(div))
+
+#endif
@@ -0,0 +1,8 @@
+/* Host-side stand-in for <avr/wdt.h>, used by the simulator build. */
+
+#ifndef _SIM_AVR_WDT_H_
+#define _SIM_AVR_WDT_H_
+
+#define wdt_disable()
+
+#endif
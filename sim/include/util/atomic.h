@@ -0,0 +1,16 @@
+/*
+ * Host-side stand-in for <util/atomic.h>, used by the simulator build.
+ *
+ * The simulator is single threaded so an atomic block is just a block.
+ */
+
+#ifndef _SIM_UTIL_ATOMIC_H_
+#define _SIM_UTIL_ATOMIC_H_
+
+#include <stdint.h>
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+#define ATOMIC_BLOCK(type) for (uint8_t __atomic_todo = 1; __atomic_todo; __atomic_todo = 0)
+
+#endif
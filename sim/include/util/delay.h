@@ -0,0 +1,9 @@
+/* Host-side stand-in for <util/delay.h>, used by the simulator build. */
+
+#ifndef _SIM_UTIL_DELAY_H_
+#define _SIM_UTIL_DELAY_H_
+
+#define _delay_ms(ms) ((void)(ms))
+#define _delay_us(us) ((void)(us))
+
+#endif
@@ -0,0 +1,610 @@
+/*
+ * Native Linux simulator for the LED matrix firmware.
+ *
+ * MIDI.c is built unchanged against the stand-in headers in
+ * sim/include. This file provides the hardware behind them: the ports, the
+ * switch matrix, EEPROM and the two MIDI stream endpoints, plus a scheduler
+ * that plays a script from stdin while running the firmware's tasks.
+ *
+ * Time is counted in ticks of 64 CPU cycles (4us at 16MHz). Every task
+ * call costs one tick, and so does every failed poll while the firmware
+ * spins on an endpoint or the EEPROM, which is how back-pressure from a slow
+ * host shows up. The timer 0 compare interrupt is raised between ticks.
+ *
+ * Script commands, one per line ('#' starts a comment):
+ *
+ *   run <passes>              run the scheduler for that many passes
+ *   press <board> <index>     close a switch (index = row * 4 + 3 - col)
+ *   release <board> <index>   open a switch
+ *   cc <chan> <num> <val>     host sends a control change
+ *   note <chan> <num> <vel>   host sends a note on (vel 0 is a note off)
+ *   sysex <byte> ...          host sends the bytes between F0 and F7
+ *   packet <b0> <b1> <b2> <b3> host sends a raw USB-MIDI event packet
+ *   poll <ticks>              host polls the IN endpoint every <ticks>, 0 stalls it
+ *   connect / disconnect      plug or unplug the USB cable
+ *   leds                      print the LED levels seen on the port pins since
+ *                             the last leds command
+ *   reload                    load the settings from EEPROM as at power up
+ *   stats                     print the tick, pass and traffic counters
+ *   queues                    print the size, fill, high-water mark, drops and
+ *                             fill histogram of the firmware's event queues,
+ *                             just size and fill without EVENT_QUEUE_STATS
+ *
+ * Output lines start with a keyword, e.g. "in <tick> <latency> <packet>"
+ * for every event packet the host receives, where latency is the number of
+ * ticks since the last switch change.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MIDI.h"
+
+#define SIM_EPSIZE 64
+#define SIM_NUM_EP 3
+#define SIM_CYCLES_PER_TICK 64
+//3.3ms
+#define SIM_EEPROM_WRITE_TICKS 825
+#define SIM_OUT_QUEUE_SIZE 4096
+//give up when the firmware spins this long on a host that never polls
+#define SIM_SPIN_LIMIT 1000000UL
+
+volatile uint8_t PORTA, PORTB, PORTC, PORTD, PORTE, PORTF;
+volatile uint8_t DDRA, DDRB, DDRC, DDRD, DDRE, DDRF;
+volatile uint8_t PINA, PINB, PINC, PIND, PINE, PINF;
+volatile uint8_t MCUSR;
+volatile uint8_t TCCR0A, TCCR0B, OCR0A, TIMSK0;
+volatile uint8_t TCCR1A, TCCR1B;
+
+//the firmware's led interrupt, if it has one
+void TIMER0_COMPA_vect(void) __attribute__ ((weak));
+
+volatile uint8_t Scheduler_TotalTasks;
+
+typedef struct {
+	uint8_t banks;
+	uint8_t dir;
+	//the bank the firmware is reading or writing
+	uint8_t data[SIM_EPSIZE];
+	uint8_t count;
+	uint8_t pos;
+	//IN: banks handed to the host but not polled yet, OUT: a bank is waiting
+	uint8_t queued[ENDPOINT_BANK_DOUBLE][SIM_EPSIZE];
+	uint8_t queued_count[ENDPOINT_BANK_DOUBLE];
+	uint8_t num_queued;
+} sim_endpoint_t;
+
+static sim_endpoint_t endpoints[SIM_NUM_EP];
+static uint8_t cur_ep;
+
+static uint16_t switches[NUM_BOARDS];
+
+//the port registers of each board, as the firmware's BOARD_PORTS has them
+#define SIM_BOARD_PORT(p) &PORT ## p,
+#define SIM_BOARD_PIN(p) &PIN ## p,
+static volatile uint8_t * const board_ports[NUM_BOARDS] = {BOARD_PORTS(SIM_BOARD_PORT)};
+static volatile uint8_t * const board_pins[NUM_BOARDS] = {BOARD_PORTS(SIM_BOARD_PIN)};
+
+//host to device bytes not yet handed to the OUT endpoint
+static uint8_t out_queue[SIM_OUT_QUEUE_SIZE];
+static uint16_t out_queue_head;
+static uint16_t out_queue_tail;
+
+static uint32_t ticks;
+static uint32_t passes;
+static uint32_t last_input_tick;
+static uint32_t eeprom_busy_until;
+static uint32_t eeprom_writes;
+static uint32_t in_packets;
+static uint32_t in_transfers;
+static uint32_t column_strobes;
+static uint32_t host_poll_interval = 1;
+static uint32_t next_host_poll;
+static uint32_t spins;
+static uint32_t timer0_cycles;
+static uint32_t timer0_interrupts;
+
+//how long each column and each of its 12 led bits were lit since the last
+//"leds" command, in cycles, decoded from PORTA/PORTE and the column grounds
+static uint32_t led_cycles[NUM_BOARDS][4];
+static uint32_t led_on_cycles[NUM_BOARDS][4][12];
+static uint64_t last_sample;
+static int8_t lit_board = -1;
+static int8_t lit_col;
+static uint16_t lit_color;
+static int8_t last_lit_board = -1;
+static int8_t last_lit_col = -1;
+
+static void HostPoll(void);
+static void SampleLEDs(uint64_t now);
+
+//clock divider selected by the CSn2:0 bits of a timer
+static uint16_t Prescale(uint8_t tccrb)
+{
+	static const uint16_t prescale[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+	return prescale[tccrb & 0x7];
+}
+
+//the passage of time
+static void Tick(void)
+{
+	uint16_t t0 = Prescale(TCCR0B);
+
+	ticks++;
+	if (t0 && (TIMSK0 & (1 << OCIE0A)) && TIMER0_COMPA_vect) {
+		timer0_cycles += SIM_CYCLES_PER_TICK;
+		while (timer0_cycles >= (uint32_t)t0 * (OCR0A + 1)) {
+			timer0_cycles -= (uint32_t)t0 * (OCR0A + 1);
+			timer0_interrupts++;
+			TIMER0_COMPA_vect();
+			SampleLEDs((uint64_t)ticks * SIM_CYCLES_PER_TICK - timer0_cycles);
+		}
+	}
+	if (host_poll_interval && ticks >= next_host_poll) {
+		next_host_poll = ticks + host_poll_interval;
+		HostPoll();
+	}
+}
+
+//a failed poll of an endpoint, time passes while the firmware waits
+static void Spin(void)
+{
+	if (++spins > SIM_SPIN_LIMIT) {
+		fprintf(stderr, "sim: firmware blocked on endpoint %u at tick %u\n", cur_ep, ticks);
+		exit(2);
+	}
+	Tick();
+}
+
+/* Ports and timers */
+
+uint16_t Sim_ReadTimer1(void)
+{
+	uint16_t t1 = Prescale(TCCR1B);
+
+	if (!t1)
+		return 0;
+	return ((uint64_t)ticks * SIM_CYCLES_PER_TICK / t1) & 0xFFFF;
+}
+
+//what the switch inputs of a board read, with the row the firmware selects
+static uint8_t ReadPin(const uint8_t board)
+{
+	uint8_t pin = 0xAA;
+	uint8_t row;
+	uint8_t col;
+
+	//the selected row is driven low on the top nibble of PORTB
+	for (row = 0; row < 4; row++) {
+		if (!(PORTB & (0x10 << row)))
+			break;
+	}
+	if (row == 4)
+		return pin;
+
+	for (col = 0; col < 4; col++) {
+		if (switches[board] & (1 << (row * 4 + (3 - col))))
+			pin &= ~(1 << (1 + col * 2));
+	}
+	return pin;
+}
+
+//decode which column is lit and what it shows, at cycle now. the state seen
+//at the last sample is credited with the time in between
+static void SampleLEDs(uint64_t now)
+{
+	uint16_t color = PORTA | ((uint16_t)(PORTE & 0x03) << 8) | ((uint16_t)(PORTE & 0xC0) << 4);
+	uint8_t board;
+	uint8_t col;
+	uint8_t bit;
+
+	if (lit_board >= 0) {
+		uint32_t dt = now - last_sample;
+		led_cycles[lit_board][lit_col] += dt;
+		for (bit = 0; bit < 12; bit++) {
+			if (lit_color & (1 << bit))
+				led_on_cycles[lit_board][lit_col][bit] += dt;
+		}
+	}
+	last_sample = now;
+	lit_board = -1;
+
+	for (board = 0; board < NUM_BOARDS; board++) {
+		for (col = 0; col < 4; col++) {
+			if (!(*board_ports[board] & (1 << (col << 1)))) {
+				if (board != last_lit_board || col != last_lit_col) {
+					column_strobes++;
+					last_lit_board = board;
+					last_lit_col = col;
+				}
+				lit_board = board;
+				lit_col = col;
+				lit_color = color;
+				return;
+			}
+		}
+	}
+}
+
+/* EEPROM */
+
+uint8_t Sim_EEPROM_IsReady(void)
+{
+	return ticks >= eeprom_busy_until;
+}
+
+void Sim_EEPROM_BusyWait(void)
+{
+	while (!Sim_EEPROM_IsReady())
+		Tick();
+}
+
+uint8_t Sim_EEPROM_ReadByte(const uint8_t * addr)
+{
+	return *addr;
+}
+
+void Sim_EEPROM_WriteByte(uint8_t * addr, uint8_t value)
+{
+	*addr = value;
+	eeprom_writes++;
+	eeprom_busy_until = ticks + SIM_EEPROM_WRITE_TICKS;
+}
+
+void Sim_EEPROM_ReadBlock(void * dst, const void * src, size_t n)
+{
+	memcpy(dst, src, n);
+}
+
+/* Endpoints */
+
+bool Endpoint_ConfigureEndpoint(const uint8_t Number, const uint8_t Type,
+		const uint8_t Direction, const uint16_t Size, const uint8_t Banks)
+{
+	sim_endpoint_t * ep;
+
+	(void)Type;
+	if (Number >= SIM_NUM_EP || Size > SIM_EPSIZE || Banks > ENDPOINT_BANK_DOUBLE)
+		return false;
+	ep = &endpoints[Number];
+	memset(ep, 0, sizeof(*ep));
+	ep->banks = Banks;
+	ep->dir = Direction;
+	return true;
+}
+
+void Endpoint_SelectEndpoint(const uint8_t EndpointNumber)
+{
+	cur_ep = EndpointNumber;
+}
+
+uint8_t Endpoint_GetCurrentEndpoint(void)
+{
+	return cur_ep;
+}
+
+bool Endpoint_IsINReady(void)
+{
+	sim_endpoint_t * ep = &endpoints[cur_ep];
+	bool ready = ep->banks && ep->num_queued < ep->banks;
+
+	if (!ready)
+		Spin();
+	else
+		spins = 0;
+	return ready;
+}
+
+bool Endpoint_IsOUTReceived(void)
+{
+	return endpoints[cur_ep].num_queued != 0;
+}
+
+bool Endpoint_IsReadWriteAllowed(void)
+{
+	sim_endpoint_t * ep = &endpoints[cur_ep];
+	bool allowed;
+
+	if (ep->dir == ENDPOINT_DIR_IN)
+		allowed = ep->banks && ep->num_queued < ep->banks && ep->count < SIM_EPSIZE;
+	else
+		allowed = ep->num_queued && ep->pos < ep->count;
+	if (!allowed)
+		Spin();
+	else
+		spins = 0;
+	return allowed;
+}
+
+uint16_t Endpoint_BytesInEndpoint(void)
+{
+	sim_endpoint_t * ep = &endpoints[cur_ep];
+
+	if (ep->dir == ENDPOINT_DIR_IN)
+		return ep->count;
+	return ep->num_queued ? ep->count - ep->pos : 0;
+}
+
+uint8_t Endpoint_Read_Byte(void)
+{
+	sim_endpoint_t * ep = &endpoints[cur_ep];
+
+	if (ep->pos < ep->count)
+		return ep->data[ep->pos++];
+	return 0;
+}
+
+void Endpoint_Write_Byte(const uint8_t Byte)
+{
+	sim_endpoint_t * ep = &endpoints[cur_ep];
+
+	if (ep->count < SIM_EPSIZE)
+		ep->data[ep->count++] = Byte;
+}
+
+void Endpoint_ClearIN(void)
+{
+	sim_endpoint_t * ep = &endpoints[cur_ep];
+
+	if (ep->num_queued >= ep->banks) {
+		fprintf(stderr, "sim: IN bank cleared while the host owns every bank\n");
+		exit(1);
+	}
+	memcpy(ep->queued[ep->num_queued], ep->data, ep->count);
+	ep->queued_count[ep->num_queued] = ep->count;
+	ep->num_queued++;
+	ep->count = 0;
+}
+
+//the OUT bank is handed back, load the next one from the host queue
+static void FillOUT(void)
+{
+	sim_endpoint_t * ep = &endpoints[MIDI_STREAM_OUT_EPNUM];
+
+	if (!ep->banks || ep->num_queued || out_queue_head == out_queue_tail)
+		return;
+	ep->count = 0;
+	ep->pos = 0;
+	while (ep->count < SIM_EPSIZE && out_queue_head != out_queue_tail) {
+		ep->data[ep->count++] = out_queue[out_queue_head];
+		out_queue_head = (out_queue_head + 1) % SIM_OUT_QUEUE_SIZE;
+	}
+	ep->num_queued = 1;
+}
+
+void Endpoint_ClearOUT(void)
+{
+	sim_endpoint_t * ep = &endpoints[cur_ep];
+
+	ep->num_queued = 0;
+	ep->count = ep->pos = 0;
+	FillOUT();
+}
+
+//the host reads every IN bank the firmware has released
+static void HostPoll(void)
+{
+	sim_endpoint_t * ep = &endpoints[MIDI_STREAM_IN_EPNUM];
+	uint8_t bank;
+	uint8_t i;
+
+	for (bank = 0; bank < ep->num_queued; bank++) {
+		in_transfers++;
+		for (i = 0; i + 3 < ep->queued_count[bank]; i += 4) {
+			in_packets++;
+			printf("in %u %u %02X %02X %02X %02X\n", ticks, ticks - last_input_tick,
+					ep->queued[bank][i], ep->queued[bank][i + 1],
+					ep->queued[bank][i + 2], ep->queued[bank][i + 3]);
+		}
+	}
+	ep->num_queued = 0;
+}
+
+void USB_Init(void)
+{
+	memset(endpoints, 0, sizeof(endpoints));
+}
+
+void USB_USBTask(void)
+{
+}
+
+/* Scheduler */
+
+void Scheduler_SetTaskMode(const TaskPtr_t Task, const bool TaskStatus)
+{
+	uint8_t i;
+
+	for (i = 0; i < Scheduler_TotalTasks; i++) {
+		if (Scheduler_TaskList[i].Task == Task)
+			Scheduler_TaskList[i].TaskStatus = TaskStatus;
+	}
+}
+
+static void RunPass(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < Scheduler_TotalTasks; i++) {
+		if (Scheduler_TaskList[i].TaskStatus == TASK_RUN) {
+			uint8_t board;
+			for (board = 0; board < NUM_BOARDS; board++)
+				*board_pins[board] = ReadPin(board);
+			spins = 0;
+			Scheduler_TaskList[i].Task();
+			Tick();
+		}
+	}
+	passes++;
+}
+
+/* Script */
+
+static void QueueOUT(const uint8_t * packet)
+{
+	uint8_t i;
+
+	for (i = 0; i < 4; i++) {
+		out_queue[out_queue_tail] = packet[i];
+		out_queue_tail = (out_queue_tail + 1) % SIM_OUT_QUEUE_SIZE;
+	}
+	FillOUT();
+}
+
+//split a sysex message into USB-MIDI event packets
+static void QueueSysex(const uint8_t * body, uint16_t len)
+{
+	uint8_t msg[SIM_OUT_QUEUE_SIZE / 4];
+	uint8_t packet[4];
+	uint16_t total = len + 2;
+	uint16_t i;
+
+	if (total > sizeof(msg))
+		return;
+	msg[0] = SYSEX_BEGIN;
+	memcpy(msg + 1, body, len);
+	msg[total - 1] = SYSEX_END;
+
+	for (i = 0; i < total; i += 3) {
+		uint16_t left = total - i;
+		memset(packet, 0, sizeof(packet));
+		if (left > 3)
+			packet[0] = 0x4;
+		else
+			packet[0] = 0x4 + left;
+		memcpy(packet + 1, msg + i, left > 3 ? 3 : left);
+		QueueOUT(packet);
+	}
+}
+
+//brightness of one led bit over the last period, 0 - 15
+static unsigned int Level(uint8_t board, uint8_t col, uint8_t bit)
+{
+	if (!led_cycles[board][col])
+		return 0;
+	return (led_on_cycles[board][col][bit] * 15ULL + led_cycles[board][col] / 2) / led_cycles[board][col];
+}
+
+static void PrintLEDs(void)
+{
+	uint8_t board;
+	uint8_t row;
+	uint8_t col;
+
+	//one line per board, buttons in index order, rgb levels as 3 hex digits.
+	//the 3 bits of a button are rbg from the top
+	SampleLEDs((uint64_t)ticks * SIM_CYCLES_PER_TICK);
+	for (board = 0; board < NUM_BOARDS; board++) {
+		printf("leds %u", board);
+		for (row = 0; row < 4; row++) {
+			for (col = 0; col < 4; col++) {
+				uint8_t c = 3 - col;
+				printf(" %X%X%X", Level(board, c, 3 * row + 2), Level(board, c, 3 * row),
+						Level(board, c, 3 * row + 1));
+			}
+		}
+		printf("\n");
+	}
+	memset(led_cycles, 0, sizeof(led_cycles));
+	memset(led_on_cycles, 0, sizeof(led_on_cycles));
+}
+
+extern EventQueue_t midiout_queue;
+extern EventQueue_t cmd_queue;
+extern void BootSettings(void);
+
+static void PrintQueue(const char * name, const EventQueue_t * q)
+{
+#if EVENT_QUEUE_STATS
+	uint8_t i;
+
+	printf("queue %s size %u fill %u high %u drops %u hist", name, EventQueue_Size(q),
+			EventQueue_Count(q), q->high_water, q->drops);
+	for (i = 0; i < EVENT_QUEUE_BINS; i++)
+		printf(" %u", q->histogram[i]);
+	printf("\n");
+#else
+	printf("queue %s size %u fill %u\n", name, EventQueue_Size(q), EventQueue_Count(q));
+#endif
+}
+
+static void Connect(void)
+{
+	RAISE_EVENT(USB_Connect);
+	RAISE_EVENT(USB_ConfigurationChanged);
+	FillOUT();
+}
+
+void Scheduler_Start(void)
+{
+	char line[1024];
+	unsigned int lineno = 0;
+
+	Connect();
+
+	while (fgets(line, sizeof(line), stdin)) {
+		char * cmd;
+		char * arg;
+		unsigned long args[SIM_OUT_QUEUE_SIZE / 4];
+		uint16_t nargs = 0;
+
+		lineno++;
+		if ((cmd = strchr(line, '#')))
+			*cmd = '\0';
+		cmd = strtok(line, " \t\r\n");
+		if (!cmd)
+			continue;
+		while ((arg = strtok(NULL, " \t\r\n")) && nargs < sizeof(args) / sizeof(args[0]))
+			args[nargs++] = strtoul(arg, NULL, 0);
+
+		if (!strcmp(cmd, "run") && nargs == 1) {
+			unsigned long i;
+			for (i = 0; i < args[0]; i++)
+				RunPass();
+		} else if ((!strcmp(cmd, "press") || !strcmp(cmd, "release")) &&
+				nargs == 2 && args[0] < NUM_BOARDS && args[1] < 16) {
+			if (cmd[0] == 'p')
+				switches[args[0]] |= (1 << args[1]);
+			else
+				switches[args[0]] &= ~(1 << args[1]);
+			last_input_tick = ticks;
+			printf("%s %u %lu %lu\n", cmd, ticks, args[0], args[1]);
+		} else if ((!strcmp(cmd, "cc") || !strcmp(cmd, "note")) && nargs == 3) {
+			uint8_t command = (cmd[0] == 'c') ? MIDI_COMMAND_CC : MIDI_COMMAND_NOTE_ON;
+			uint8_t packet[4] = {command >> 4, command | (args[0] & 0x0F), args[1] & 0x7F, args[2] & 0x7F};
+			QueueOUT(packet);
+		} else if (!strcmp(cmd, "sysex")) {
+			uint8_t body[SIM_OUT_QUEUE_SIZE / 4];
+			uint16_t i;
+			for (i = 0; i < nargs; i++)
+				body[i] = args[i];
+			QueueSysex(body, nargs);
+		} else if (!strcmp(cmd, "packet") && nargs == 4) {
+			uint8_t packet[4] = {args[0], args[1], args[2], args[3]};
+			QueueOUT(packet);
+		} else if (!strcmp(cmd, "poll") && nargs == 1) {
+			host_poll_interval = args[0];
+			next_host_poll = ticks + host_poll_interval;
+		} else if (!strcmp(cmd, "connect")) {
+			Connect();
+		} else if (!strcmp(cmd, "disconnect")) {
+			RAISE_EVENT(USB_Disconnect);
+		} else if (!strcmp(cmd, "leds")) {
+			PrintLEDs();
+		} else if (!strcmp(cmd, "queues")) {
+			PrintQueue("midiout", &midiout_queue);
+			PrintQueue("cmd", &cmd_queue);
+		} else if (!strcmp(cmd, "reload")) {
+			BootSettings();
+		} else if (!strcmp(cmd, "stats")) {
+			printf("stats ticks %u passes %u timer0 %u strobes %u in_packets %u in_transfers %u eeprom_writes %u\n",
+					ticks, passes, timer0_interrupts, column_strobes, in_packets, in_transfers, eeprom_writes);
+		} else {
+			fprintf(stderr, "sim: line %u: bad command '%s'\n", lineno, cmd);
+			exit(1);
+		}
+		fflush(stdout);
+	}
+	exit(0);
+}